@@ -0,0 +1,185 @@
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "anomaly.h"
+#include "error.h"
+#include "events.h"
+#include "i18n.h"
+#include "state.h"
+
+// weight of a new observation in the baseline
+#define ALPHA		0.01
+// observations before alarms are raised
+#define WARMUP		50
+// CUSUM slack (in standard deviations): drifts smaller than this are ignored
+#define K		0.5
+#define DEFAULT_H	5.0
+
+// only load steps at least this big give a usable resistance estimate
+#define MIN_CURRENT_STEP	0.5	// A, smaller ones drown in the mV resolution of the voltage
+#define MAX_RESISTANCE		2.0	// ohm, anything above is not a load step
+#define MIN_CHARGE_CURRENT	0.2	// A
+// USB output voltage, not measured by the bank
+#define USB_VOLTAGE		5.0
+// a consistent shift of the HV voltage by more than this is a new set point (inc-hv/dec-hv)
+#define HV_SETPOINT_MOVE	0.1	// V
+
+static void init(cusum_t *const c, const char *const name, const int direction, const double sd_floor)
+{
+	memset(c, 0x00, sizeof *c);
+
+	c->name = name;
+	c->direction = direction;
+	c->sd_floor = sd_floor;
+	c->h = DEFAULT_H;
+}
+
+anomaly_detector::anomaly_detector(event_log *const elog, const char *const config) : elog(elog), have_prev(false), prev_voltage(0.), prev_current(0.), hv_setpoint(0.), hv_n_held(0), hv_same_sign(0), hv_was_on(false)
+{
+	init(&resistance, "battery-resistance", 1, 0.005);
+	init(&charge_temperature, "charge-temperature-ratio", -1, 0.001);
+	init(&hv_ripple, "hv-ripple", 1, 0.02);
+
+	cusum_t *const all[] = { &resistance, &charge_temperature, &hv_ripple };
+	const char *const short_names[] = { "resistance", "charge-temperature", "hv-ripple" };
+
+	char *copy = strdup(config), *saveptr = NULL;
+
+	for(char *item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+		double h = DEFAULT_H;
+
+		char *is = strchr(item, '=');
+		if (is) {
+			*is = 0x00;
+			h = atof(is + 1);
+
+			if (h <= 0)
+				error_exit(false, _("%s: threshold must be above 0"), item);
+		}
+
+		bool found = false;
+
+		for(int i=0; i<3; i++) {
+			if (strcasecmp(item, "all") == 0 || strcasecmp(item, short_names[i]) == 0) {
+				all[i]->enabled = true;
+				all[i]->h = h;
+				found = true;
+			}
+		}
+
+		if (!found)
+			error_exit(false, _("%s: use all, resistance, charge-temperature or hv-ripple"), item);
+	}
+
+	free(copy);
+}
+
+anomaly_detector::~anomaly_detector()
+{
+}
+
+void anomaly_detector::observe(cusum_t *const c, const double x, const sample_t & s)
+{
+	if (!c->enabled)
+		return;
+
+	if (c->n == 0)
+		c->mean = x;
+
+	if (c->n >= WARMUP) {
+		double sd = std::max(sqrt(c->var), c->sd_floor);
+		double z = c->direction * (x - c->mean) / sd;
+
+		// capped, so that it clears within a reasonable time once the signal is back to normal
+		c->s = std::min(std::max(0., c->s + z - K), c->h * 2);
+
+		if (!c->alarm && c->s > c->h) {
+			c->alarm = true;
+			elog->alert(s, c->name, true, x);
+		}
+		else if (c->alarm && c->s == 0.) {
+			c->alarm = false;
+			elog->alert(s, c->name, false, x);
+		}
+	}
+
+	if (!c->alarm) {
+		double d = x - c->mean;
+
+		c->mean += ALPHA * d;
+		c->var = (1 - ALPHA) * (c->var + ALPHA * d * d);
+	}
+
+	c->n++;
+}
+
+void anomaly_detector::check(const sample_t & s)
+{
+	const std::vector<uint8_t> & state = s.state;
+
+	double voltage = get_battery_voltage(state);
+	double charging = get_charging_current(state);
+	double hv_voltage = get_hv_output_voltage(state);
+
+	// current drawn from the battery, from the power the outputs deliver
+	double current = 0.;
+	if (voltage > 0.)
+		current = (get_hv_output_current(state) * hv_voltage + get_usb_output_current(state) * USB_VOLTAGE) / voltage - charging;
+
+	// internal resistance from the voltage sag at a load step
+	if (have_prev && fabs(current - prev_current) >= MIN_CURRENT_STEP) {
+		double r = (prev_voltage - voltage) / (current - prev_current);
+
+		if (r > 0. && r < MAX_RESISTANCE)
+			observe(&resistance, r, s);
+	}
+
+	prev_voltage = voltage;
+	prev_current = current;
+	have_prev = true;
+
+	double temp = get_temp(state);
+
+	if (charging >= MIN_CHARGE_CURRENT && temp > 0.)
+		observe(&charge_temperature, charging / temp, s);
+
+	// ripple: deviation from the set point, which is tracked slowly. a
+	// deviation with the same sign for a few samples is a new set point
+	// (inc-hv/dec-hv), so deviations are observed with a delay and
+	// dropped when they turn out to be such a step
+	bool hv_on = get_hv_output_on(state);
+
+	if (hv_on && hv_was_on) {
+		double d = hv_voltage - hv_setpoint;
+
+		if (fabs(d) > HV_SETPOINT_MOVE && hv_same_sign && (d > 0) == (hv_held[hv_n_held - 1] > 0))
+			hv_same_sign++;
+		else
+			hv_same_sign = fabs(d) > HV_SETPOINT_MOVE;
+
+		if (hv_same_sign >= HV_STEP_SAMPLES) {
+			hv_setpoint = hv_voltage;
+			hv_n_held = hv_same_sign = 0;
+		}
+		else {
+			if (hv_n_held == HV_STEP_SAMPLES - 1) {
+				observe(&hv_ripple, fabs(hv_held[0]), s);
+
+				memmove(&hv_held[0], &hv_held[1], (HV_STEP_SAMPLES - 2) * sizeof(double));
+				hv_n_held--;
+			}
+
+			hv_held[hv_n_held++] = d;
+
+			hv_setpoint += ALPHA * d;
+		}
+	}
+	else {
+		hv_setpoint = hv_voltage;
+		hv_n_held = hv_same_sign = 0;
+	}
+
+	hv_was_on = hv_on;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "events.h"
+#include "state.h"
+
+// samples in a row that deviate in the same direction for a change of the HV set point
+#define HV_STEP_SAMPLES	3
+
+// One-sided CUSUM on a standardized observation, with the baseline
+// (mean/variance) learned by an EWMA. The baseline is frozen while the
+// alarm is raised so that it doesn't adapt to the fault.
+typedef struct {
+	const char *name;
+	bool enabled;
+	int direction;		// +1 to detect an increase, -1 for a decrease
+	double sd_floor;	// so that a perfectly stable signal doesn't make every change an alarm
+	double h;		// decision threshold (in standard deviations)
+
+	double mean, var;
+	uint64_t n;		// observations so far, no alarms during warm-up
+	double s;		// cumulative sum
+	bool alarm;
+} cusum_t;
+
+// Online detection of fault precursors: rising internal resistance of the
+// battery (voltage sag under load), the charging current dropping relative
+// to the temperature and ripple on the HV output. Alerts end up in the
+// event log (and its hook) as events with a value.
+class anomaly_detector
+{
+private:
+	event_log *const elog;
+
+	cusum_t resistance, charge_temperature, hv_ripple;
+
+	bool have_prev;
+	double prev_voltage, prev_current;
+
+	double hv_setpoint;
+	double hv_held[HV_STEP_SAMPLES - 1];	// deviations not yet known not to be a set point change
+	int hv_n_held, hv_same_sign;
+	bool hv_was_on;
+
+	void observe(cusum_t *const c, const double x, const sample_t & s);
+
+public:
+	// config: "all" or comma separated resistance, charge-temperature and/or hv-ripple, each optionally =threshold
+	anomaly_detector(event_log *const elog, const char *const config);
+	virtual ~anomaly_detector();
+
+	void check(const sample_t & s);
+};
@@ -0,0 +1,691 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "error.h"
+#include "i18n.h"
+#include "state.h"
+
+// column 0 in a block are the timestamps, these follow: first the
+// measurements[], stored as the int16 the bank sends and divided by their
+// scale when read, then the rest
+static const char *const columns[] = {
+	"temperature",
+	"battery-voltage",
+	"charging-current",
+	"HV-output-current",
+	"HV-output-voltage",
+	"USB-output-current",
+	"flags-0x22",
+	"flags-0x23",
+	"battery-uptime",
+	"bq24295-reg-0",
+	"bq24295-reg-1",
+	"bq24295-reg-2",
+	"bq24295-reg-3",
+	"bq24295-reg-4",
+	"bq24295-reg-5",
+	"bq24295-reg-6",
+	"bq24295-reg-7",
+	"bq24295-reg-8",
+	"bq24295-reg-9",
+	NULL
+};
+
+// zero delta-of-deltas in a row that are stored as a run length
+#define DOD_MIN_RUN	22
+#define DOD_MAX_RUN	65535
+
+#define N_COLUMNS	(int(sizeof columns / sizeof columns[0]) - 1)
+
+// magic, n, t_first, t_last, n_columns, column sizes (including the timestamps)
+#define BLOCK_HEADER_SIZE	(4 + 4 + 8 + 8 + 4 + 4 * (N_COLUMNS + 1))
+
+static int64_t column_value(const int nr, const std::vector<uint8_t> & state)
+{
+	if (nr < N_MEASUREMENTS)
+		return get_raw(measurements[nr], state);
+
+	switch(nr) {
+		case 6: return get_flags_0x22(state);
+		case 7: return get_flags_0x23(state);
+		case 8: return get_battery_uptime(state);
+	}
+
+	return state.at(0x18 + nr - 9);
+}
+
+int archive_find_column(const char *const name)
+{
+	for(int i=0; columns[i]; i++) {
+		if (strcasecmp(columns[i], name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+std::vector<std::string> archive_column_names()
+{
+	std::vector<std::string> out;
+
+	for(int i=0; columns[i]; i++)
+		out.push_back(columns[i]);
+
+	return out;
+}
+
+bit_writer::bit_writer() : n_bits(0)
+{
+}
+
+void bit_writer::put(const uint64_t v, const int n)
+{
+	for(int i=n - 1; i>=0; i--) {
+		if ((n_bits & 7) == 0)
+			buffer.push_back(0);
+
+		if ((v >> i) & 1)
+			buffer.back() |= 128 >> (n_bits & 7);
+
+		n_bits++;
+	}
+}
+
+void bit_writer::clear()
+{
+	buffer.clear();
+	n_bits = 0;
+}
+
+bit_reader::bit_reader(const uint8_t *const p, const size_t size) : p(p), size(size), bit(0)
+{
+}
+
+uint64_t bit_reader::get(const int n)
+{
+	uint64_t v = 0;
+
+	for(int i=0; i<n; i++) {
+		size_t byte = bit >> 3;
+
+		if (byte >= size)
+			error_exit(false, _("Archive is corrupt"));
+
+		v <<= 1;
+		v |= (p[byte] >> (7 - (bit & 7))) & 1;
+
+		bit++;
+	}
+
+	return v;
+}
+
+static int64_t sign_extend(const uint64_t v, const int n)
+{
+	if (v & (1ull << (n - 1)))
+		return int64_t(v | (~0ull << n));
+
+	return int64_t(v);
+}
+
+dod_encoder::dod_encoder()
+{
+	clear();
+}
+
+void dod_encoder::clear()
+{
+	bw.clear();
+	prev = prev_delta = 0;
+	n = zeros = 0;
+}
+
+// a run costs 5 + 16 bits, single zeros 1 bit each
+void dod_encoder::put_zeros()
+{
+	while(zeros >= DOD_MIN_RUN) {
+		uint32_t run = std::min(zeros, uint32_t(DOD_MAX_RUN));
+
+		bw.put(31, 5);
+		bw.put(run, 16);
+
+		zeros -= run;
+	}
+
+	for(; zeros; zeros--)
+		bw.put(0, 1);
+}
+
+void dod_encoder::finish()
+{
+	put_zeros();
+}
+
+void dod_encoder::add(const int64_t v)
+{
+	if (n++ == 0) {
+		bw.put(uint64_t(v), 64);
+		prev = v;
+		return;
+	}
+
+	int64_t delta = v - prev;
+	int64_t dod = delta - prev_delta;
+
+	if (dod == 0) {
+		zeros++;
+		prev = v;
+		return;
+	}
+
+	put_zeros();
+
+	if (dod >= -64 && dod <= 63) {
+		bw.put(2, 2);
+		bw.put(uint64_t(dod), 7);
+	}
+	else if (dod >= -256 && dod <= 255) {
+		bw.put(6, 3);
+		bw.put(uint64_t(dod), 9);
+	}
+	else if (dod >= -2048 && dod <= 2047) {
+		bw.put(14, 4);
+		bw.put(uint64_t(dod), 12);
+	}
+	else {
+		bw.put(30, 5);
+		bw.put(uint64_t(dod), 64);
+	}
+
+	prev = v;
+	prev_delta = delta;
+}
+
+dod_decoder::dod_decoder(const uint8_t *const p, const size_t size) : br(p, size), prev(0), prev_delta(0), n(0), zeros(0)
+{
+}
+
+int64_t dod_decoder::get()
+{
+	if (n++ == 0) {
+		prev = int64_t(br.get(64));
+		return prev;
+	}
+
+	int64_t dod = 0;
+
+	if (zeros)
+		zeros--;
+	else if (br.get(1) == 0)
+		dod = 0;
+	else if (br.get(1) == 0)
+		dod = sign_extend(br.get(7), 7);
+	else if (br.get(1) == 0)
+		dod = sign_extend(br.get(9), 9);
+	else if (br.get(1) == 0)
+		dod = sign_extend(br.get(12), 12);
+	else if (br.get(1) == 0)
+		dod = int64_t(br.get(64));
+	else {
+		zeros = br.get(16);
+
+		// a run is at least DOD_MIN_RUN long: this one is the first of it
+		if (zeros < DOD_MIN_RUN)
+			error_exit(false, _("Archive is corrupt"));
+
+		zeros--;
+	}
+
+	prev_delta += dod;
+	prev += prev_delta;
+
+	return prev;
+}
+
+static void write_all(const int fd, const void *const p, const size_t n, const std::string & file)
+{
+	if (write(fd, p, n) != ssize_t(n))
+		error_exit(true, _("Problem writing to %s"), file.c_str());
+}
+
+typedef struct {
+	uint32_t n;
+	int64_t t_first, t_last;
+	uint32_t sizes[N_COLUMNS + 1];
+	uint64_t length;	// header + data
+} block_header_t;
+
+static bool read_block_header(const int fd, const uint64_t offset, block_header_t *const h)
+{
+	uint8_t buffer[BLOCK_HEADER_SIZE];
+
+	if (pread(fd, buffer, sizeof buffer, offset) != sizeof buffer)
+		return false;
+
+	uint32_t magic = 0, n_columns = 0;
+	memcpy(&magic, &buffer[0], 4);
+	memcpy(&h->n, &buffer[4], 4);
+	memcpy(&h->t_first, &buffer[8], 8);
+	memcpy(&h->t_last, &buffer[16], 8);
+	memcpy(&n_columns, &buffer[24], 4);
+
+	if (magic != ARCHIVE_BLOCK_MAGIC || n_columns != N_COLUMNS + 1)
+		return false;
+
+	h->length = BLOCK_HEADER_SIZE;
+
+	for(int i=0; i<=N_COLUMNS; i++) {
+		memcpy(&h->sizes[i], &buffer[28 + i * 4], 4);
+		h->length += h->sizes[i];
+	}
+
+	return true;
+}
+
+static std::string index_file(const std::string & file)
+{
+	return file + ".idx";
+}
+
+// expired blocks are holes (read as zeros): find where the next block starts
+static uint64_t skip_zeros(const int fd, uint64_t offset, const uint64_t size)
+{
+	off_t data = lseek(fd, offset, SEEK_DATA);
+	if (data == -1)
+		return errno == ENXIO ? size : offset;
+
+	offset = data;
+
+	uint8_t buffer[4096];
+
+	while(offset < size) {
+		ssize_t rc = pread(fd, buffer, sizeof buffer, offset);
+		if (rc <= 0)
+			break;
+
+		for(ssize_t i=0; i<rc; i++) {
+			if (buffer[i])
+				return offset + i;
+		}
+
+		offset += rc;
+	}
+
+	return size;
+}
+
+// rewrites the index from the block headers, cuts off a block that was not written completely
+void archive_rebuild_index(const std::string & file)
+{
+	int fd = open(file.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd == -1)
+		error_exit(true, _("Failed opening %s"), file.c_str());
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		error_exit(true, _("Failed opening %s"), file.c_str());
+
+	std::string idx = index_file(file);
+	int idx_fd = open(idx.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (idx_fd == -1)
+		error_exit(true, _("Failed opening %s"), idx.c_str());
+
+	uint64_t offset = 0, end = 0;
+	block_header_t h;
+
+	// the first format stored the measurements as doubles: don't cut such an archive off
+	uint32_t magic = 0;
+	if (pread(fd, &magic, sizeof magic, skip_zeros(fd, 0, st.st_size)) == sizeof magic && magic == ARCHIVE_BLOCK_MAGIC_V1)
+		error_exit(false, _("%s is in an older archive format, use a new file"), file.c_str());
+
+	for(;;) {
+		offset = skip_zeros(fd, offset, st.st_size);
+
+		if (!read_block_header(fd, offset, &h) || offset + h.length > uint64_t(st.st_size))
+			break;
+
+		archive_index_t e = { h.t_first, h.t_last, offset };
+		write_all(idx_fd, &e, sizeof e, idx);
+
+		offset += h.length;
+		end = offset;
+	}
+
+	if (end != uint64_t(st.st_size) && ftruncate(fd, end) == -1)
+		error_exit(true, _("Problem writing to %s"), file.c_str());
+
+	close(idx_fd);
+	close(fd);
+}
+
+std::vector<archive_index_t> archive_load_index(const std::string & file)
+{
+	std::vector<archive_index_t> out;
+
+	std::string idx = index_file(file);
+
+	int fd = open(idx.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return out;
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size >= ssize_t(sizeof(archive_index_t))) {
+		out.resize(st.st_size / sizeof(archive_index_t));
+
+		if (pread(fd, out.data(), out.size() * sizeof(archive_index_t), 0) != ssize_t(out.size() * sizeof(archive_index_t)))
+			out.clear();
+	}
+
+	close(fd);
+
+	return out;
+}
+
+void archive_writer::open_files()
+{
+	fd = open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1)
+		error_exit(true, _("Failed opening %s"), file.c_str());
+
+	// index and data must agree, e.g. after a crash
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		error_exit(true, _("Failed opening %s"), file.c_str());
+
+	std::vector<archive_index_t> index = archive_load_index(file);
+	block_header_t h;
+
+	bool ok = index.empty() ? st.st_size == 0 : read_block_header(fd, index.back().offset, &h) && index.back().offset + h.length == uint64_t(st.st_size);
+
+	if (!ok)
+		archive_rebuild_index(file);
+
+	std::string idx = index_file(file);
+	idx_fd = open(idx.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (idx_fd == -1)
+		error_exit(true, _("Failed opening %s"), idx.c_str());
+}
+
+archive_writer::archive_writer(const std::string & file, const int64_t retain) : file(file), retain(retain), n(0), t_first(0), t_last(0), block_start(0)
+{
+	open_files();
+
+	cols.resize(N_COLUMNS);
+
+	for(int i=0; rollup_tiers[i].suffix; i++)
+		tiers.push_back(new rollup_tier(file, rollup_tiers[i].suffix, rollup_tiers[i].period));
+}
+
+archive_writer::~archive_writer()
+{
+	flush();
+
+	for(auto & t : tiers)
+		delete t;
+
+	close(idx_fd);
+	close(fd);
+}
+
+void archive_writer::add(const sample_t & s)
+{
+	int64_t t = s.wall_us / 1000;
+
+	if (n == 0) {
+		t_first = t;
+		block_start = s.mono_us;
+	}
+
+	t_last = t;
+
+	for(auto & tier : tiers)
+		tier->add(s);
+
+	ts.add(t);
+
+	for(int i=0; i<N_COLUMNS; i++)
+		cols.at(i).add(column_value(i, s.state));
+
+	// a partial block is written after a while so that a crash doesn't lose much
+	if (++n >= ARCHIVE_BLOCK_SAMPLES || s.mono_us - block_start >= ARCHIVE_FLUSH_INTERVAL * 1000000ull)
+		flush();
+}
+
+void archive_writer::flush()
+{
+	if (n == 0)
+		return;
+
+	std::vector<const std::vector<uint8_t> *> data;
+
+	ts.finish();
+	data.push_back(&ts.bw.get());
+
+	for(auto & e : cols) {
+		e.finish();
+		data.push_back(&e.bw.get());
+	}
+
+	std::vector<uint8_t> block(BLOCK_HEADER_SIZE);
+
+	uint32_t magic = ARCHIVE_BLOCK_MAGIC, n_columns = N_COLUMNS + 1;
+	memcpy(&block[0], &magic, 4);
+	memcpy(&block[4], &n, 4);
+	memcpy(&block[8], &t_first, 8);
+	memcpy(&block[16], &t_last, 8);
+	memcpy(&block[24], &n_columns, 4);
+
+	for(size_t i=0; i<data.size(); i++) {
+		uint32_t size = data.at(i)->size();
+		memcpy(&block[28 + i * 4], &size, 4);
+
+		block.insert(block.end(), data.at(i)->begin(), data.at(i)->end());
+	}
+
+	off_t offset = lseek(fd, 0, SEEK_END);
+
+	write_all(fd, block.data(), block.size(), file);
+
+	archive_index_t e = { t_first, t_last, uint64_t(offset) };
+	write_all(idx_fd, &e, sizeof e, index_file(file));
+
+	ts.clear();
+
+	for(auto & e : cols)
+		e.clear();
+
+	n = 0;
+
+	if (retain)
+		expire();
+}
+
+void archive_writer::expire()
+{
+	std::vector<archive_index_t> index = archive_load_index(file);
+
+	int64_t cutoff = t_last - retain;
+
+	if (index.empty() || index.front().t_last >= cutoff)
+		return;
+
+	close(idx_fd);
+	close(fd);
+
+	archive_expire(file, cutoff);
+
+	open_files();
+}
+
+// copies the blocks that are in the index to a new file
+static void archive_compact(const std::string & file)
+{
+	std::vector<archive_index_t> index = archive_load_index(file);
+
+	int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		error_exit(true, _("Failed opening %s"), file.c_str());
+
+	std::string temp = file + ".tmp";
+	int out = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out == -1)
+		error_exit(true, _("Failed opening %s"), temp.c_str());
+
+	for(auto & e : index) {
+		block_header_t h;
+		if (!read_block_header(fd, e.offset, &h))
+			error_exit(false, _("Archive is corrupt"));
+
+		std::vector<uint8_t> block(h.length);
+		if (pread(fd, block.data(), block.size(), e.offset) != ssize_t(block.size()))
+			error_exit(false, _("Archive is corrupt"));
+
+		write_all(out, block.data(), block.size(), temp);
+	}
+
+	if (fsync(out) == -1)
+		error_exit(true, _("Problem writing to %s"), temp.c_str());
+
+	close(out);
+	close(fd);
+
+	if (rename(temp.c_str(), file.c_str()) == -1)
+		error_exit(true, _("Problem writing to %s"), file.c_str());
+
+	archive_rebuild_index(file);
+}
+
+// removes the blocks that only hold samples from before cutoff: they're
+// dropped from the index and their space is given back by punching a hole,
+// so the rest of the file stays where it is. only on file systems that
+// can't punch holes the file is rewritten.
+void archive_expire(const std::string & file, const int64_t cutoff)
+{
+	std::vector<archive_index_t> index = archive_load_index(file), keep;
+
+	for(auto & e : index) {
+		if (e.t_last >= cutoff)
+			keep.push_back(e);
+	}
+
+	if (keep.size() == index.size())
+		return;
+
+	// index first: a crash in between leaves blocks that are not indexed, never the other way around
+	std::string idx = index_file(file), temp = idx + ".tmp";
+
+	int idx_fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (idx_fd == -1)
+		error_exit(true, _("Failed opening %s"), temp.c_str());
+
+	if (!keep.empty())
+		write_all(idx_fd, keep.data(), keep.size() * sizeof(archive_index_t), temp);
+
+	if (fsync(idx_fd) == -1)
+		error_exit(true, _("Problem writing to %s"), temp.c_str());
+
+	close(idx_fd);
+
+	if (rename(temp.c_str(), idx.c_str()) == -1)
+		error_exit(true, _("Problem writing to %s"), idx.c_str());
+
+	int fd = open(file.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd == -1)
+		error_exit(true, _("Failed opening %s"), file.c_str());
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		error_exit(true, _("Failed opening %s"), file.c_str());
+
+	// everything that is not a block in the index is free: the blocks that
+	// were just expired and the holes from before. punched as a whole, also
+	// when the blocks are smaller than those of the file system.
+	std::vector<std::pair<uint64_t, uint64_t> > free_ranges;
+	uint64_t prev_end = 0;
+
+	for(auto & e : keep) {
+		block_header_t h;
+		if (!read_block_header(fd, e.offset, &h))
+			error_exit(false, _("Archive is corrupt"));
+
+		if (e.offset > prev_end)
+			free_ranges.push_back({ prev_end, e.offset - prev_end });
+
+		prev_end = e.offset + h.length;
+	}
+
+	if (keep.empty() && st.st_size > 0)
+		free_ranges.push_back({ 0, st.st_size });
+
+	bool compact = false;
+
+	for(auto & r : free_ranges) {
+		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, r.first, r.second) == -1) {
+			if (errno != EOPNOTSUPP)
+				error_exit(true, _("Problem writing to %s"), file.c_str());
+
+			compact = true;
+			break;
+		}
+	}
+
+	close(fd);
+
+	if (compact)
+		archive_compact(file);
+}
+
+void archive_scan(const std::string & file, const int column_nr, const int64_t t_from, const int64_t t_to, void (*cb)(const int64_t t, const double v, void *arg), void *arg)
+{
+	std::vector<archive_index_t> index = archive_load_index(file);
+
+	int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		error_exit(true, _("Failed opening %s"), file.c_str());
+
+	for(auto & e : index) {
+		if (e.t_last < t_from || e.t_first > t_to)
+			continue;
+
+		block_header_t h;
+		if (!read_block_header(fd, e.offset, &h))
+			error_exit(false, _("Archive is corrupt"));
+
+		// only the timestamps and the selected column are read
+		uint64_t ts_offset = e.offset + BLOCK_HEADER_SIZE, col_offset = ts_offset;
+
+		for(int i=0; i<=column_nr; i++)
+			col_offset += h.sizes[i];
+
+		std::vector<uint8_t> ts_data(h.sizes[0]), col_data(h.sizes[column_nr + 1]);
+
+		if (pread(fd, ts_data.data(), ts_data.size(), ts_offset) != ssize_t(ts_data.size()) ||
+			pread(fd, col_data.data(), col_data.size(), col_offset) != ssize_t(col_data.size()))
+			error_exit(false, _("Archive is corrupt"));
+
+		dod_decoder ts(ts_data.data(), ts_data.size());
+		dod_decoder col(col_data.data(), col_data.size());
+
+		for(uint32_t i=0; i<h.n; i++) {
+			int64_t t = ts.get();
+			double v = column_nr < N_MEASUREMENTS ? col.get() / measurements[column_nr].scale : double(col.get());
+
+			if (t > t_to)
+				break;
+
+			if (t >= t_from)
+				cb(t, v, arg);
+		}
+	}
+
+	close(fd);
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "rollup.h"
+#include "state.h"
+
+// samples per block
+#define ARCHIVE_BLOCK_SAMPLES	3600
+// a block is written when it is full or after this many seconds
+#define ARCHIVE_FLUSH_INTERVAL	300
+
+#define ARCHIVE_BLOCK_MAGIC	0x32434250	// "PBC2"
+#define ARCHIVE_BLOCK_MAGIC_V1	0x41434250	// "PBCA", not supported anymore
+
+class bit_writer
+{
+private:
+	std::vector<uint8_t> buffer;
+	uint64_t n_bits;
+
+public:
+	bit_writer();
+
+	void put(const uint64_t v, const int n);
+
+	void clear();
+	const std::vector<uint8_t> & get() const { return buffer; }
+};
+
+class bit_reader
+{
+private:
+	const uint8_t *const p;
+	const size_t size;
+	uint64_t bit;
+
+public:
+	bit_reader(const uint8_t *const p, const size_t size);
+
+	uint64_t get(const int n);
+};
+
+// integers: delta-of-delta, long runs of a constant delta (e.g. a value
+// that doesn't change) as one run length
+class dod_encoder
+{
+private:
+	int64_t prev, prev_delta;
+	uint32_t n, zeros;
+
+	void put_zeros();
+
+public:
+	bit_writer bw;
+
+	dod_encoder();
+
+	void add(const int64_t v);
+	// call before using bw
+	void finish();
+	void clear();
+};
+
+class dod_decoder
+{
+private:
+	bit_reader br;
+	int64_t prev, prev_delta;
+	uint32_t n, zeros;
+
+public:
+	dod_decoder(const uint8_t *const p, const size_t size);
+
+	int64_t get();
+};
+
+// one entry per block in <archive>.idx, the sparse time index
+typedef struct {
+	int64_t t_first, t_last;	// ms since the epoch
+	uint64_t offset;
+} archive_index_t;
+
+// Columnar, compressed store of samples. Each field of the state frame is
+// a column of its own, stored as the integer the bank sends (measurements
+// in their int16 units, scaled when read back); blocks of
+// ARCHIVE_BLOCK_SAMPLES samples (or what came in during
+// ARCHIVE_FLUSH_INTERVAL) are written to <file>, with an index entry in
+// <file>.idx. The rollup tiers are kept up to date as well; blocks older
+// than retain (ms, 0 is forever) are removed while the rollups stay.
+class archive_writer
+{
+private:
+	const std::string file;
+	const int64_t retain;
+	int fd, idx_fd;
+
+	std::vector<rollup_tier *> tiers;
+
+	void open_files();
+	void expire();
+
+	dod_encoder ts;
+	std::vector<dod_encoder> cols;
+
+	uint32_t n;
+	int64_t t_first, t_last;
+	uint64_t block_start;	// CLOCK_MONOTONIC (us) of the first sample in the block
+
+public:
+	archive_writer(const std::string & file, const int64_t retain);
+	virtual ~archive_writer();
+
+	void add(const sample_t & s);
+	void flush();
+};
+
+int archive_find_column(const char *const name);
+std::vector<std::string> archive_column_names();
+
+std::vector<archive_index_t> archive_load_index(const std::string & file);
+void archive_rebuild_index(const std::string & file);
+void archive_expire(const std::string & file, const int64_t cutoff);
+
+// calls cb for each stored sample of column nr within [t_from, t_to] (ms)
+void archive_scan(const std::string & file, const int column_nr, const int64_t t_from, const int64_t t_to, void (*cb)(const int64_t t, const double v, void *arg), void *arg);
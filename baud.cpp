@@ -0,0 +1,18 @@
+// kept apart from serial.cpp: asm/termbits.h and termios.h can't be mixed
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+// rates that have no Bxxx constant
+bool set_custom_baudrate(const int fd, const unsigned baudrate)
+{
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) == -1)
+		return false;
+
+	tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	tio.c_ispeed = tio.c_ospeed = baudrate;
+
+	return ioctl(fd, TCSETS2, &tio) == 0;
+}
@@ -0,0 +1,374 @@
+// micro-benchmarks of the per-sample code paths, run with "make bench"
+// all input comes from an in-memory state frame: no powerbank needed
+// output: one JSON object per benchmark per line, on stdout
+#include <algorithm>
+#include <dlfcn.h>
+#include <functional>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "archive.h"
+#include "error.h"
+#include "state.h"
+#include "ui.h"
+#include "utils.h"
+
+// how long each benchmark runs at least
+#define MIN_DURATION	500000 // us
+
+// every allocation goes through these, also operator new and the ones done
+// by the C library itself (asprintf & co). the real allocator is looked up
+// with dlsym(RTLD_NEXT): that works with any libc. dlsym can allocate
+// before the lookup is done, that is served from a static buffer.
+static uint64_t n_allocs = 0;
+
+static void *(*real_malloc)(size_t) = NULL;
+static void *(*real_calloc)(size_t, size_t) = NULL;
+static void *(*real_realloc)(void *, size_t) = NULL;
+static void (*real_free)(void *) = NULL;
+static void *(*real_memalign)(size_t, size_t) = NULL;
+static void *(*real_aligned_alloc)(size_t, size_t) = NULL;
+static int (*real_posix_memalign)(void **, size_t, size_t) = NULL;
+
+alignas(64) static char bootstrap[16384];
+static size_t bootstrap_used = 0;
+
+static void *bootstrap_alloc(const size_t alignment, const size_t n)
+{
+	size_t offset = (bootstrap_used + alignment - 1) / alignment * alignment;
+
+	if (offset + n > sizeof bootstrap)
+		abort();
+
+	bootstrap_used = offset + n;
+
+	return bootstrap + offset;  // static: already zeroed
+}
+
+static bool in_bootstrap(const void *const p)
+{
+	return p >= bootstrap && p < bootstrap + sizeof bootstrap;
+}
+
+static void resolve()
+{
+	static bool resolving = false;
+
+	if (resolving)
+		return;
+
+	resolving = true;
+
+	real_malloc = reinterpret_cast<void *(*)(size_t)>(dlsym(RTLD_NEXT, "malloc"));
+	real_calloc = reinterpret_cast<void *(*)(size_t, size_t)>(dlsym(RTLD_NEXT, "calloc"));
+	real_realloc = reinterpret_cast<void *(*)(void *, size_t)>(dlsym(RTLD_NEXT, "realloc"));
+	real_free = reinterpret_cast<void (*)(void *)>(dlsym(RTLD_NEXT, "free"));
+	real_memalign = reinterpret_cast<void *(*)(size_t, size_t)>(dlsym(RTLD_NEXT, "memalign"));
+	real_aligned_alloc = reinterpret_cast<void *(*)(size_t, size_t)>(dlsym(RTLD_NEXT, "aligned_alloc"));
+	real_posix_memalign = reinterpret_cast<int (*)(void **, size_t, size_t)>(dlsym(RTLD_NEXT, "posix_memalign"));
+
+	resolving = false;
+}
+
+extern "C" {
+void *malloc(size_t n)
+{
+	n_allocs++;
+
+	if (!real_malloc)
+		resolve();
+
+	return real_malloc ? real_malloc(n) : bootstrap_alloc(16, n);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	n_allocs++;
+
+	if (!real_calloc)
+		resolve();
+
+	return real_calloc ? real_calloc(n, size) : bootstrap_alloc(16, n * size);
+}
+
+void *realloc(void *p, size_t n)
+{
+	n_allocs++;
+
+	if (!real_realloc)
+		resolve();
+
+	if (in_bootstrap(p) || !real_realloc) {
+		// the old size is not known: copy what can be there
+		void *np = real_malloc ? real_malloc(n) : bootstrap_alloc(16, n);
+
+		if (p && np)
+			memcpy(np, p, std::min(n, size_t(bootstrap + sizeof bootstrap - static_cast<char *>(p))));
+
+		return np;
+	}
+
+	return real_realloc(p, n);
+}
+
+void free(void *p)
+{
+	if (in_bootstrap(p))
+		return;
+
+	if (!real_free)
+		resolve();
+
+	if (real_free)
+		real_free(p);
+}
+
+void *memalign(size_t alignment, size_t n)
+{
+	n_allocs++;
+
+	if (!real_memalign)
+		resolve();
+
+	return real_memalign ? real_memalign(alignment, n) : bootstrap_alloc(alignment, n);
+}
+
+void *aligned_alloc(size_t alignment, size_t n)
+{
+	n_allocs++;
+
+	if (!real_aligned_alloc)
+		resolve();
+
+	return real_aligned_alloc ? real_aligned_alloc(alignment, n) : bootstrap_alloc(alignment, n);
+}
+
+int posix_memalign(void **p, size_t alignment, size_t n)
+{
+	n_allocs++;
+
+	if (!real_posix_memalign)
+		resolve();
+
+	if (real_posix_memalign)
+		return real_posix_memalign(p, alignment, n);
+
+	*p = bootstrap_alloc(alignment, n);
+
+	return 0;
+}
+}
+
+static FILE *out = NULL;
+
+static void bench(const char *const name, std::function<void()> f)
+{
+	// warm up, e.g. gettext initialization
+	f();
+
+	uint64_t iterations = 1, took = 0, allocs = 0;
+
+	for(;;) {
+		uint64_t allocs_start = n_allocs;
+		uint64_t start = get_us(CLOCK_MONOTONIC);
+
+		for(uint64_t i=0; i<iterations; i++)
+			f();
+
+		took = get_us(CLOCK_MONOTONIC) - start;
+		allocs = n_allocs - allocs_start;
+
+		if (took >= MIN_DURATION)
+			break;
+
+		iterations *= 2;
+	}
+
+	fprintf(out, "{ \"benchmark\" : \"%s\", \"iterations\" : %llu, \"ns-per-op\" : %.1f, \"allocs-per-op\" : %.2f, \"version\" : \"%s\" }\n", name, (unsigned long long)iterations, took * 1000.0 / iterations, double(allocs) / iterations, VERSION);
+	fflush(out);
+}
+
+static std::vector<uint8_t> make_frame()
+{
+	std::vector<uint8_t> state(STATE_FRAME_SIZE);
+
+	auto put16 = [&state](const int offset, const int v) {
+		state.at(offset) = v;
+		state.at(offset + 1) = v >> 8;
+	};
+
+	put16(0x00, 2512);	// temperature
+	put16(0x02, 3900);	// battery voltage
+	put16(0x04, 500);	// charging current
+	put16(0x06, 300);	// HV output current
+	put16(0x08, 200);	// USB output current
+	put16(0x0a, 12000);	// HV output voltage
+
+	const uint8_t regs[] = { 0x30, 0x1b, 0x40, 0x11, 0xb2, 0x8c, 0x73, 0x4b, 0x24, 0x00 };
+	memcpy(&state.at(0x18), regs, sizeof regs);
+
+	state.at(0x22) = 32 | 16;
+	state.at(0x23) = 128 | 64;
+
+	put16(0x24, 1000);	// uptime
+
+	return state;
+}
+
+// one block worth of awkward input for the archive codec: irregular
+// timestamps (all delta-of-delta widths, also backwards) and int16
+// measurements with noise, constant stretches, steps and the extremes.
+// both also have a long run of a constant delta
+static void make_series(std::vector<int64_t> *const times, std::vector<int64_t> *const counts)
+{
+	uint64_t seed = 1;
+	auto rnd = [&seed]() { seed = seed * 6364136223846793005ull + 1442695040888963407ull; return seed >> 33; };
+
+	int64_t t = 1790000000000ll;
+	int64_t v = 3900;
+
+	for(int i=0; i<ARCHIVE_BLOCK_SAMPLES; i++) {
+		int64_t step = 1000;
+
+		switch(i >= 2000 && i < 2500 ? 7 : rnd() % 8) {
+			case 0: step += int64_t(rnd() % 100) - 50; break;
+			case 1: step += int64_t(rnd() % 4000) - 2000; break;
+			case 2: step = int64_t(rnd() % 100000000) - 50000000; break;
+			default: break;
+		}
+
+		t += step;
+		times->push_back(t);
+
+		switch(i >= 1000 && i < 1500 ? 7 : rnd() % 8) {
+			case 0: v = -v; break;
+			case 1: v += int64_t(rnd() % 11) - 5; break;
+			case 2: v = int64_t(rnd() % 65536) - 32768; break;
+			case 3: v = rnd() & 1 ? 32767 : -32768; break;
+			case 4: v += int64_t(rnd() % 1001) - 500; break;
+			default: break;
+		}
+
+		v = std::max(int64_t(-32768), std::min(int64_t(32767), v));
+		counts->push_back(v);
+	}
+}
+
+// encodes and decodes a block, exits when something doesn't come back as it went in
+static void archive_codec_roundtrip(const std::vector<int64_t> & times, const std::vector<int64_t> & counts)
+{
+	dod_encoder te, ce;
+
+	for(size_t i=0; i<times.size(); i++) {
+		te.add(times.at(i));
+		ce.add(counts.at(i));
+	}
+
+	te.finish();
+	ce.finish();
+
+	dod_decoder td(te.bw.get().data(), te.bw.get().size());
+	dod_decoder cd(ce.bw.get().data(), ce.bw.get().size());
+
+	for(size_t i=0; i<times.size(); i++) {
+		// stderr goes to /dev/null
+		if (td.get() != times.at(i) || cd.get() != counts.at(i)) {
+			fprintf(out, "{ \"benchmark\" : \"archive-codec\", \"error\" : \"round trip failed at sample %zu\" }\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	// results go to the original stdout, what the code under test prints is discarded
+	int fd = dup(1);
+	if (fd == -1)
+		error_exit(true, "dup failed");
+
+	out = fdopen(fd, "w");
+
+	if (!freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr))
+		error_exit(true, "Cannot redirect stdout/stderr to /dev/null");
+
+	auto selected = [argc, argv](const char *const name) {
+		if (argc < 2)
+			return true;
+
+		for(int i=1; i<argc; i++) {
+			if (strcmp(argv[i], name) == 0)
+				return true;
+		}
+
+		return false;
+	};
+
+	const std::vector<uint8_t> frame = make_frame();
+	volatile double sink = 0.;
+
+	if (selected("frame-parse")) {
+		frame_parser fp;
+		std::vector<uint8_t> state;
+
+		bench("frame-parse", [&fp, &frame, &state, &sink]() {
+			fp.feed(frame.data(), frame.size());
+
+			if (fp.next(&state))
+				sink = sink + state.at(0);
+		});
+	}
+
+	if (selected("decode")) {
+		bench("decode", [&frame, &sink]() {
+			double v = 0.;
+
+			for(int i=0; measurements[i].name; i++)
+				v += measurements[i].get(frame);
+
+			for(int i=0; flags[i].name; i++)
+				v += (frame.at(flags[i].offset) & flags[i].mask) != 0;
+
+			v += get_battery_uptime(frame);
+			v += get_i2c_BQ24295(frame).at(2);
+
+			sink = sink + v;
+		});
+	}
+
+	if (selected("dump-json"))
+		bench("dump-json", [&frame]() { dump_state("fakebank", "fake powerbank v1.0", frame, true); });
+
+	if (selected("dump-text"))
+		bench("dump-text", [&frame]() { dump_state("fakebank", "fake powerbank v1.0", frame, false); });
+
+	max_x = 80;
+	max_y = 24;
+
+	if (selected("graph-line")) {
+		char line[80];
+		double scale_voltage = (max_x - 1) / 24.0, scale_current = (max_x - 1) / 3.0;
+
+		bench("graph-line", [&line, &frame, scale_voltage, scale_current]() { graph_line(line, frame, scale_voltage, scale_current); });
+	}
+
+	if (selected("format-help"))
+		bench("format-help", []() { format_help("-H x", "--host-plan", "while on battery (ups and shed mode), throttle this system following a comma separated list of governor:name (cpufreq governor), max-freq:x (maximum cpu frequency in kHz or x% of the maximum) or cpu:slice=x (limit cgroup slice to x% of one cpu), in the order in which they're applied."); });
+
+	if (selected("archive-codec")) {
+		std::vector<int64_t> times, counts;
+		make_series(&times, &counts);
+
+		// also checks the codec: pbc-bench exits with an error when it doesn't round trip
+		bench("archive-codec", [&times, &counts]() { archive_codec_roundtrip(times, counts); });
+	}
+
+	fclose(out);
+
+	return 0;
+}
@@ -1 +1 @@
-void error_exit(const bool se, const char *format, ...);
+void error_exit(const bool se, const char *format, ...) __attribute__ ((noreturn));
@@ -0,0 +1,262 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/wait.h>
+
+#include "error.h"
+#include "events.h"
+#include "i18n.h"
+#include "state.h"
+#include "utils.h"
+
+// how often the background thread writes out what is queued
+#define FLUSH_INTERVAL	250 // ms
+
+event_log::event_log(const char *const target, const char *const hook) : head(0), tail(0), dropped(0), have_prev(false), fd(-1), use_syslog(false), hook(hook), stop(false), hook_stop(false), hook_th(NULL)
+{
+	if (!target) {
+	}
+	else if (strcasecmp(target, "syslog") == 0) {
+		openlog("powerbankcontrol", LOG_PID, LOG_DAEMON);
+		use_syslog = true;
+	}
+	else if (strcmp(target, "-") == 0) {
+		fd = 1;
+	}
+	else {
+		fd = open(target, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (fd == -1)
+			error_exit(true, _("Failed opening %s"), target);
+	}
+
+	if (hook)
+		hook_th = start_thread([this]() { hook_runner(); });
+
+	th = start_thread([this]() { flusher(); });
+}
+
+event_log::~event_log()
+{
+	finish();
+
+	if (use_syslog)
+		closelog();
+	else if (fd > 2)
+		close(fd);
+}
+
+void event_log::finish()
+{
+	if (!th)
+		return;
+
+	stop = true;
+
+	th->join();
+	delete th;
+	th = NULL;
+
+	// after the last flush: what is queued still gets its hook
+	if (hook_th) {
+		{
+			std::lock_guard<std::mutex> lck(hook_lock);
+			hook_stop = true;
+		}
+
+		hook_cv.notify_one();
+
+		hook_th->join();
+		delete hook_th;
+		hook_th = NULL;
+	}
+}
+
+void event_log::push(const pb_event_t & e)
+{
+	uint32_t h = head.load(std::memory_order_relaxed);
+
+	if (h - tail.load(std::memory_order_acquire) >= EVENT_RING_SIZE) {
+		dropped++;
+		return;
+	}
+
+	ring[h & (EVENT_RING_SIZE - 1)] = e;
+
+	head.store(h + 1, std::memory_order_release);
+}
+
+void event_log::check(const sample_t & s)
+{
+	const std::vector<uint8_t> & state = s.state;
+	uint8_t cur[2] = { get_flags_0x22(state), get_flags_0x23(state) };
+
+	if (have_prev && (cur[0] != prev[0] || cur[1] != prev[1])) {
+		pb_event_t e;
+		e.mono_us = s.mono_us;
+		e.wall_us = s.wall_us;
+		e.has_value = false;
+		e.value = 0.;
+
+		for(int i=0; flags[i].name; i++) {
+			int nr = flags[i].offset - 0x22;
+			uint8_t changed = cur[nr] ^ prev[nr];
+
+			if (changed & flags[i].mask) {
+				e.name = flags[i].name;
+				e.on = cur[nr] & flags[i].mask;
+
+				push(e);
+			}
+		}
+	}
+
+	memcpy(prev, cur, sizeof prev);
+	have_prev = true;
+}
+
+void event_log::alert(const sample_t & s, const char *const name, const bool on, const double value)
+{
+	pb_event_t e;
+	e.mono_us = s.mono_us;
+	e.wall_us = s.wall_us;
+	e.name = name;
+	e.on = on;
+	e.has_value = true;
+	e.value = value;
+
+	push(e);
+}
+
+// the details are passed in the environment: PBC_EVENT, PBC_STATE (on/off),
+// PBC_TIME (ms since 1970) and PBC_VALUE (anomalies only)
+void event_log::run_hook(const pb_event_t & e)
+{
+	// not setenv(): other threads may call getenv()
+	std::vector<std::string> env;
+	env.push_back(std::string("PBC_EVENT=") + e.name);
+	env.push_back(std::string("PBC_STATE=") + (e.on ? "on" : "off"));
+	env.push_back("PBC_TIME=" + std::to_string(e.wall_us / 1000));
+
+	if (e.has_value)
+		env.push_back("PBC_VALUE=" + std::to_string(e.value));
+
+	std::vector<char *> envp;
+
+	for(char **p = environ; *p; p++)
+		envp.push_back(*p);
+
+	for(auto & v : env)
+		envp.push_back((char *)v.c_str());
+
+	envp.push_back(NULL);
+
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		execle("/bin/sh", "sh", "-c", hook, (char *)NULL, envp.data());
+		_exit(127);
+	}
+
+	if (pid == -1)
+		fprintf(stderr, _("Cannot start event hook: %s\n"), strerror(errno));
+	else
+		waitpid(pid, NULL, 0);
+}
+
+void event_log::flush()
+{
+	uint32_t t = tail.load(std::memory_order_relaxed);
+	uint32_t h = head.load(std::memory_order_acquire);
+
+	if (t == h)
+		return;
+
+	std::string batch;
+	std::vector<pb_event_t> hooked;
+
+	for(; t != h; t++) {
+		const pb_event_t & e = ring[t & (EVENT_RING_SIZE - 1)];
+
+		time_t now = e.wall_us / 1000000;
+		struct tm tm;
+		localtime_r(&now, &tm);
+
+		char ts[32];
+		strftime(ts, sizeof ts, "%Y-%m-%d %H:%M:%S", &tm);
+
+		char value[48] = "";
+		if (e.has_value)
+			snprintf(value, sizeof value, ", \"value\" : %f", e.value);
+
+		char line[256];
+		snprintf(line, sizeof line, "{ \"time\" : \"%s.%03u\", \"wall-ms\" : %llu, \"mono-ms\" : %llu, \"event\" : \"%s\", \"state\" : %s%s }\n",
+				ts, unsigned(e.wall_us / 1000 % 1000), (unsigned long long)(e.wall_us / 1000), (unsigned long long)(e.mono_us / 1000), e.name, e.on ? "true" : "false", value);
+
+		if (use_syslog)
+			syslog(LOG_NOTICE, "%s", line);
+		else if (fd != -1)
+			batch += line;
+
+		if (hook)
+			hooked.push_back(e);
+	}
+
+	tail.store(t, std::memory_order_release);
+
+	if (!batch.empty() && write(fd, batch.c_str(), batch.size()) != ssize_t(batch.size()))
+		fprintf(stderr, _("Problem writing event log\n"));
+
+	if (hooked.empty())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lck(hook_lock);
+
+		for(auto & e : hooked) {
+			if (hook_queue.size() >= EVENT_HOOK_QUEUE)
+				dropped++;
+			else
+				hook_queue.push_back(e);
+		}
+	}
+
+	hook_cv.notify_one();
+}
+
+// one hook at a time, in the order of the events
+void event_log::hook_runner()
+{
+	std::unique_lock<std::mutex> lck(hook_lock);
+
+	for(;;) {
+		hook_cv.wait(lck, [this]() { return hook_stop || !hook_queue.empty(); });
+
+		if (hook_queue.empty())
+			break;
+
+		pb_event_t e = hook_queue.front();
+		hook_queue.pop_front();
+
+		lck.unlock();
+		run_hook(e);
+		lck.lock();
+	}
+}
+
+void event_log::flusher()
+{
+	while(!stop) {
+		usleep(FLUSH_INTERVAL * 1000);
+
+		flush();
+	}
+
+	flush();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include "state.h"
+
+// must be a power of 2
+#define EVENT_RING_SIZE	1024
+// events waiting for the hook before new ones are dropped
+#define EVENT_HOOK_QUEUE	256
+
+typedef struct {
+	uint64_t mono_us, wall_us;	// CLOCK_MONOTONIC, CLOCK_REALTIME
+	const char *name;
+	bool on;
+	bool has_value;		// anomalies carry the observation that raised/cleared them
+	double value;
+} pb_event_t;
+
+// Detects transitions of the flags in 0x22/0x23. Events are queued in a
+// lock-free single producer/single consumer ring and written in batches
+// by a background thread, so detecting never waits for the disk. The
+// hook, if any, runs for each event from a thread of its own so that a
+// slow hook doesn't hold up the log.
+class event_log
+{
+private:
+	pb_event_t ring[EVENT_RING_SIZE];
+	std::atomic<uint32_t> head, tail;
+	std::atomic<uint64_t> dropped;
+
+	bool have_prev;
+	uint8_t prev[2];
+
+	int fd;
+	bool use_syslog;
+	const char *hook;
+
+	std::atomic<bool> stop;
+	std::thread *th;
+
+	std::mutex hook_lock;
+	std::condition_variable hook_cv;
+	std::deque<pb_event_t> hook_queue;
+	bool hook_stop;
+	std::thread *hook_th;
+
+	void push(const pb_event_t & e);
+	void run_hook(const pb_event_t & e);
+	void flush();
+	void flusher();
+	void hook_runner();
+
+public:
+	// target: file to append to, "-" for stdout, "syslog" (ends up in the journal) or NULL for only the hook
+	// hook: shell command to run for each event, NULL for none
+	event_log(const char *const target, const char *const hook);
+	virtual ~event_log();
+
+	// stops the background threads after writing (and hooking) what is queued, also done by the destructor
+	void finish();
+
+	void check(const sample_t & s);
+	// from the same thread as check()
+	void alert(const sample_t & s, const char *const name, const bool on, const double value);
+
+	// events lost because the ring or the hook queue was full
+	uint64_t get_dropped() const { return dropped; }
+};
@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "error.h"
+#include "governor.h"
+#include "i18n.h"
+#include "serial.h"
+#include "source.h"
+#include "state.h"
+
+// BQ24295 register 0: input source control, bits 2-0 are the input current limit
+#define REG_INPUT		0
+// register 2: charge current control, bits 7-2: 512 mA + 64 mA per step
+#define REG_CHARGE		2
+#define ICHG_MIN		512
+#define ICHG_MAX		3008
+#define ICHG_STEP		64
+
+// the current is raised by at most this much per write
+#define MAX_STEP_UP		256	// mA
+// the temperature must drop this much below where the current was lowered before it's raised again
+#define HYSTERESIS		1.0	// C
+
+static const int iinlim[] = { 100, 150, 500, 900, 1000, 1500, 2000, 3000 };
+
+thermal_governor::thermal_governor(state_source *const src, const char *const config) : src(src), last_write(0), written(false), bank_input(-1)
+{
+	for(int i=0; i<10; i++)
+		sent[i] = -1;
+
+	cfg.min_charge = ICHG_MIN;
+	cfg.max_charge = 2048;
+	cfg.max_input = 2000;
+	cfg.cold = 5.;
+	cfg.soft = 40.;
+	cfg.hard = 50.;
+	cfg.interval = 10;
+
+	char *copy = strdup(config ? config : ""), *saveptr = NULL;
+
+	for(char *item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+		char *is = strchr(item, '=');
+		if (!is)
+			error_exit(false, _("%s: expecting key=value"), item);
+
+		*is = 0x00;
+		const char *value = is + 1;
+
+		if (strcasecmp(item, "min") == 0)
+			cfg.min_charge = atoi(value);
+		else if (strcasecmp(item, "max") == 0)
+			cfg.max_charge = atoi(value);
+		else if (strcasecmp(item, "input") == 0)
+			cfg.max_input = atoi(value);
+		else if (strcasecmp(item, "cold") == 0)
+			cfg.cold = atof(value);
+		else if (strcasecmp(item, "soft") == 0)
+			cfg.soft = atof(value);
+		else if (strcasecmp(item, "hard") == 0)
+			cfg.hard = atof(value);
+		else if (strcasecmp(item, "interval") == 0)
+			cfg.interval = atoi(value);
+		else
+			error_exit(false, _("%s is not a governor setting"), item);
+	}
+
+	free(copy);
+
+	// whatever was configured, stay within what the chip can do
+	cfg.min_charge = std::max(ICHG_MIN, std::min(cfg.min_charge, ICHG_MAX));
+	cfg.max_charge = std::max(cfg.min_charge, std::min(cfg.max_charge, ICHG_MAX));
+	cfg.max_input = std::max(iinlim[2], std::min(cfg.max_input, iinlim[7]));
+
+	if (cfg.hard <= cfg.soft)
+		error_exit(false, _("The hard temperature limit must be above the soft one"));
+}
+
+thermal_governor::~thermal_governor()
+{
+}
+
+int thermal_governor::target_charge(const double temp) const
+{
+	if (temp >= cfg.hard || temp <= cfg.cold)
+		return cfg.min_charge;
+
+	if (temp <= cfg.soft)
+		return cfg.max_charge;
+
+	return cfg.max_charge - (cfg.max_charge - cfg.min_charge) * (temp - cfg.soft) / (cfg.hard - cfg.soft);
+}
+
+bool thermal_governor::may_raise(const uint64_t now) const
+{
+	return !written || now - last_write >= cfg.interval * 1000000ull;
+}
+
+void thermal_governor::write_register(const int idx, const uint8_t value, const uint64_t now)
+{
+	// the frame may not show an earlier write yet: don't send it again
+	if (sent[idx] == value && !may_raise(now))
+		return;
+
+	uint8_t cmd[4];
+	bq24295_command(idx, value, cmd);
+
+	src->command(cmd, sizeof cmd);
+
+	sent[idx] = value;
+	last_write = now;
+	written = true;
+}
+
+// lowering is done straight away, raising at most once per interval
+void thermal_governor::process(const sample_t & s)
+{
+	const std::vector<uint8_t> & state = s.state;
+
+	// nothing to govern when not charging
+	if (!get_charging_port_plugged_in(state))
+		return;
+
+	std::vector<uint8_t> regs = get_i2c_BQ24295(state);
+	double temp = get_temp(state);
+
+	int cur = ICHG_MIN + ((regs.at(REG_CHARGE) >> 2) & 0x3f) * ICHG_STEP;
+	int target = cur;
+
+	int down = target_charge(temp), up = target_charge(temp + HYSTERESIS);
+
+	if (get_battery_too_hot(state) || get_battery_too_cold(state))
+		target = cfg.min_charge;
+	else if (down < cur)
+		target = down;
+	else if (up > cur && may_raise(s.mono_us)) {
+		// no use in raising it when the battery doesn't take what it may already have (nearly full)
+		if (get_charging_current(state) * 1000 >= cur / 2)
+			target = std::min(up, cur + MAX_STEP_UP);
+	}
+
+	target = ICHG_MIN + (target - ICHG_MIN) / ICHG_STEP * ICHG_STEP;
+
+	if (target != cur) {
+		fprintf(stderr, _("%.2f C: charge current %d -> %d mA\n"), temp, cur, target);
+
+		write_register(REG_CHARGE, (regs.at(REG_CHARGE) & 0x03) | (((target - ICHG_MIN) / ICHG_STEP) << 2), s.mono_us);
+	}
+
+	// the input current limit is the bank's business until the charge
+	// current has to be derated; it then scales along (never below 500 mA
+	// and never above what the bank had) and is given back afterwards
+	int cur_code = regs.at(REG_INPUT) & 0x07, code = cur_code;
+
+	if (target < cfg.max_charge) {
+		if (bank_input == -1)
+			bank_input = cur_code;
+
+		double ratio = cfg.max_charge == cfg.min_charge ? 1. : double(target - cfg.min_charge) / (cfg.max_charge - cfg.min_charge);
+		int input = iinlim[2] + (cfg.max_input - iinlim[2]) * ratio;
+
+		code = 2;
+		while(code < 7 && iinlim[code + 1] <= input)
+			code++;
+
+		code = std::min(code, bank_input);
+	}
+	else if (bank_input != -1) {
+		if (cur_code >= bank_input)
+			bank_input = -1;
+		else
+			code = bank_input;
+	}
+
+	if (code < cur_code || (code > cur_code && may_raise(s.mono_us))) {
+		fprintf(stderr, _("%.2f C: input current limit %d -> %d mA\n"), temp, iinlim[cur_code], iinlim[code]);
+
+		write_register(REG_INPUT, (regs.at(REG_INPUT) & 0xf8) | code, s.mono_us);
+	}
+}
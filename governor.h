@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "source.h"
+#include "state.h"
+
+typedef struct {
+	int min_charge, max_charge;	// mA, fast charge current (REG02)
+	int max_input;			// mA, input current limit (REG00)
+	double cold, soft, hard;	// degrees celsius
+	int interval;			// minimum seconds between a register write and raising a value
+} governor_config_t;
+
+// Lowers the fast charge current and input current limit of the BQ24295
+// gradually between the soft and hard temperature limits instead of
+// letting the bank hit its too-hot cutoff. Registers are only written when
+// they differ from what the bank reports. Lowering is immediate, raising
+// happens at most once per interval.
+class thermal_governor
+{
+private:
+	state_source *const src;
+	governor_config_t cfg;
+
+	uint64_t last_write;
+	bool written;
+	int sent[10];		// last value written per register, -1 for none
+	int bank_input;		// REG00 input limit code before it was lowered, -1 when not lowered
+
+	int target_charge(const double temp) const;
+	bool may_raise(const uint64_t now) const;
+	void write_register(const int idx, const uint8_t value, const uint64_t now);
+
+public:
+	// config: comma separated key=value: min, max, input (mA), cold, soft, hard (C), interval (s)
+	thermal_governor(state_source *const src, const char *const config);
+	virtual ~thermal_governor();
+
+	void process(const sample_t & s);
+};
@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <glob.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include "error.h"
+#include "hostsave.h"
+#include "i18n.h"
+#include "state.h"
+
+// cgroup v2 cpu.max period
+#define CPU_PERIOD	100000 // us
+
+static bool read_file(const std::string & path, std::string *const out)
+{
+	FILE *fh = fopen(path.c_str(), "re");
+	if (!fh) {
+		fprintf(stderr, _("Cannot read %s: %s\n"), path.c_str(), strerror(errno));
+		return false;
+	}
+
+	char buffer[256];
+	bool ok = fgets(buffer, sizeof buffer, fh) != NULL;
+
+	fclose(fh);
+
+	if (ok) {
+		char *lf = strchr(buffer, '\n');
+		if (lf)
+			*lf = 0x00;
+
+		*out = buffer;
+	}
+
+	return ok;
+}
+
+static bool write_file(const std::string & path, const std::string & value)
+{
+	FILE *fh = fopen(path.c_str(), "we");
+	if (!fh) {
+		fprintf(stderr, _("Cannot write %s: %s\n"), path.c_str(), strerror(errno));
+		return false;
+	}
+
+	// sysfs reports a rejected value when the buffer is flushed
+	bool ok = fprintf(fh, "%s\n", value.c_str()) > 0;
+	ok = fclose(fh) == 0 && ok;
+
+	if (!ok)
+		fprintf(stderr, _("Cannot write \"%s\" to %s: %s\n"), value.c_str(), path.c_str(), strerror(errno));
+
+	return ok;
+}
+
+// error_exit() (from any thread) skips the destructor: exit() restores through this one
+static std::mutex active_lock;
+static host_saver *active = NULL;
+
+void host_saver_restore_at_exit()
+{
+	std::lock_guard<std::mutex> lck(active_lock);
+
+	if (active) {
+		std::lock_guard<std::mutex> lck2(active->lock);
+		active->restore_stages({ });
+	}
+}
+
+host_saver::host_saver(const char *const plan, const char *const sysfs_root, const char *const cgroup_root, const bool dry_run) : sysfs_root(sysfs_root), cgroup_root(cgroup_root), dry_run(dry_run)
+{
+	parse_plan(plan, [this](char *const item) {
+		host_stage_t s { HA_GOVERNOR, "", 0, false, { } };
+
+		char *colon = strchr(item, ':');
+		if (!colon || colon[1] == 0x00)
+			error_exit(false, _("%s: use governor:name, max-freq:kHz (or %%) or cpu:slice=percentage, optionally followed by @voltage"), item);
+
+		*colon = 0x00;
+		char *value = colon + 1;
+
+		if (strcasecmp(item, "governor") == 0) {
+			s.action = HA_GOVERNOR;
+			s.value = value;
+		}
+		else if (strcasecmp(item, "max-freq") == 0) {
+			s.action = HA_MAX_FREQ;
+			s.amount = atoi(value);
+			s.percentage = strchr(value, '%') != NULL;
+
+			if (s.amount <= 0 || (s.percentage && s.amount > 100))
+				error_exit(false, _("%s: invalid frequency"), value);
+		}
+		else if (strcasecmp(item, "cpu") == 0) {
+			char *is = strchr(value, '=');
+			if (!is || strstr(value, ".."))
+				error_exit(false, _("%s: expecting slice=percentage"), value);
+
+			*is = 0x00;
+			s.action = HA_CPU_MAX;
+			s.value = value;
+			s.amount = atoi(is + 1);
+
+			if (s.amount <= 0)
+				error_exit(false, _("%s: invalid percentage"), is + 1);
+		}
+		else
+			error_exit(false, _("%s is not a host action"), item);
+
+		stages.push_back(s);
+	});
+
+	if (stages.empty())
+		error_exit(false, _("Host power-saving plan is empty"));
+
+	std::lock_guard<std::mutex> lck(active_lock);
+
+	static bool registered = false;
+	if (!registered) {
+		atexit(host_saver_restore_at_exit);
+		registered = true;
+	}
+
+	active = this;
+}
+
+host_saver::~host_saver()
+{
+	std::lock_guard<std::mutex> lck(active_lock);
+
+	if (active == this)
+		active = NULL;
+
+	// don't leave the host throttled
+	std::lock_guard<std::mutex> lck2(lock);
+	restore_stages({ });
+}
+
+std::vector<std::string> host_saver::cpufreq_policies() const
+{
+	std::vector<std::string> out;
+
+	std::string pattern = sysfs_root + "/devices/system/cpu/cpufreq/policy*";
+
+	glob_t g;
+	if (glob(pattern.c_str(), 0, NULL, &g) == 0) {
+		for(size_t i=0; i<g.gl_pathc; i++)
+			out.push_back(g.gl_pathv[i]);
+	}
+
+	globfree(&g);
+
+	if (out.empty())
+		fprintf(stderr, _("No cpufreq policies in %s\n"), pattern.c_str());
+
+	return out;
+}
+
+bool host_saver::apply(const size_t nr, const std::vector<uint8_t> & state)
+{
+	host_stage_t *const s = &stages.at(nr);
+	double voltage = get_battery_voltage(state);
+
+	std::vector<std::pair<std::string, std::string> > writes;
+
+	if (s->action == HA_GOVERNOR) {
+		fprintf(stderr, _("On battery (%.3f V): switching cpufreq governor to %s\n"), voltage, s->value.c_str());
+
+		if (dry_run)
+			return true;
+
+		for(auto & p : cpufreq_policies())
+			writes.push_back({ p + "/scaling_governor", s->value });
+	}
+	else if (s->action == HA_MAX_FREQ) {
+		fprintf(stderr, _("On battery (%.3f V): limiting cpu frequency to %d%s\n"), voltage, s->amount, s->percentage ? "%" : " kHz");
+
+		if (dry_run)
+			return true;
+
+		for(auto & p : cpufreq_policies()) {
+			long long khz = s->amount;
+
+			if (s->percentage) {
+				std::string max;
+				if (!read_file(p + "/cpuinfo_max_freq", &max))
+					continue;
+
+				khz = atoll(max.c_str()) * s->amount / 100;
+			}
+
+			writes.push_back({ p + "/scaling_max_freq", std::to_string(khz) });
+		}
+	}
+	else {
+		fprintf(stderr, _("On battery (%.3f V): limiting %s to %d%% of a cpu\n"), voltage, s->value.c_str(), s->amount);
+
+		if (dry_run)
+			return true;
+
+		writes.push_back({ cgroup_root + "/" + s->value + "/cpu.max", std::to_string(CPU_PERIOD * s->amount / 100) + " " + std::to_string(CPU_PERIOD) });
+	}
+
+	for(auto & w : writes) {
+		std::string old;
+		if (!read_file(w.first, &old))
+			continue;
+
+		if (write_file(w.first, w.second))
+			s->saved.push_back({ w.first, old });
+	}
+
+	return true;
+}
+
+// called in reverse order, so that when stages touch the same file the oldest value ends up there
+bool host_saver::restore(const size_t nr, const std::vector<uint8_t> &)
+{
+	host_stage_t *const s = &stages.at(nr);
+
+	if (!s->saved.empty())
+		fprintf(stderr, _("Restoring host settings (%s)\n"), s->action == HA_CPU_MAX ? s->value.c_str() : s->action == HA_GOVERNOR ? "governor" : "max-freq");
+
+	for(auto & saved : s->saved)
+		write_file(saved.path, saved.value);
+
+	s->saved.clear();
+
+	return true;
+}
+
+void host_saver::process(const sample_t & s)
+{
+	std::lock_guard<std::mutex> lck(lock);
+
+	staged_plan::process(s);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "staging.h"
+#include "state.h"
+
+typedef enum { HA_GOVERNOR, HA_MAX_FREQ, HA_CPU_MAX } host_action_t;
+
+typedef struct {
+	std::string path;
+	std::string value;	// what was there before
+} host_saved_t;
+
+typedef struct {
+	host_action_t action;
+	std::string value;	// HA_GOVERNOR: name, HA_CPU_MAX: slice
+	int amount;		// HA_MAX_FREQ: kHz or percentage, HA_CPU_MAX: percentage of one cpu
+	bool percentage;	// HA_MAX_FREQ
+	std::vector<host_saved_t> saved;
+} host_stage_t;
+
+// While running on battery, throttles the host itself (cpufreq, cgroup cpu
+// limits) in the order of the plan to make the battery last longer. The
+// original settings are written back once the charging port has been powered
+// again for a little while, or when the program stops (also via exit()).
+// With dry_run (replay) the actions are only printed.
+class host_saver : public staged_plan
+{
+private:
+	const std::string sysfs_root, cgroup_root;
+	const bool dry_run;
+	std::vector<host_stage_t> stages;
+	std::mutex lock;
+
+	std::vector<std::string> cpufreq_policies() const;
+
+	friend void host_saver_restore_at_exit();
+
+protected:
+	bool apply(const size_t nr, const std::vector<uint8_t> & state);
+	bool restore(const size_t nr, const std::vector<uint8_t> & state);
+
+public:
+	// plan: comma separated list of governor:name, max-freq:kHz (or %), cpu:slice=percentage, each optionally followed by @voltage
+	host_saver(const char *const plan, const char *const sysfs_root, const char *const cgroup_root, const bool dry_run);
+	virtual ~host_saver();
+
+	void process(const sample_t & s);
+};
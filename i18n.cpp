@@ -0,0 +1,29 @@
+#include <libintl.h>
+#include <locale.h>
+#include <mutex>
+
+#include "i18n.h"
+
+static std::once_flag i18n_initialized;
+
+// only messages and the character set: LC_NUMERIC must stay "C", the JSON
+// that is produced needs a decimal point
+static void i18n_setup()
+{
+	setlocale(LC_CTYPE, "");
+	setlocale(LC_MESSAGES, "");
+	bindtextdomain("powerbankcontrol", "/usr/share/locale");
+	textdomain("powerbankcontrol");
+}
+
+void i18n_init()
+{
+	std::call_once(i18n_initialized, i18n_setup);
+}
+
+const char *i18n_gettext(const char *const msgid)
+{
+	i18n_init();
+
+	return gettext(msgid);
+}
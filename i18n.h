@@ -0,0 +1,11 @@
+#pragma once
+
+// gettext() that sets up the locale on first use: one-shot commands that
+// never print anything don't pay for it
+const char *i18n_gettext(const char *const msgid);
+
+// set up the locale now; call this before starting threads, setlocale()
+// is not thread-safe
+void i18n_init();
+
+#define _(s) i18n_gettext(s)
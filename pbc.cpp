@@ -1,783 +1,520 @@
 #include <algorithm>
+#include <atomic>
 #include <fcntl.h>
+#include <functional>
 #include <getopt.h>
-#include <libintl.h>
-#include <locale.h>
 #include <poll.h>
-#include <stdarg.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
 #include <string.h>
-#include <termios.h>
+#include <thread>
+#include <time.h>
 #include <unistd.h>
 #include <vector>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 
+#include "anomaly.h"
+#include "archive.h"
 #include "error.h"
+#include "events.h"
+#include "governor.h"
+#include "hostsave.h"
+#include "i18n.h"
+#include "ring.h"
+#include "serial.h"
+#include "shed.h"
+#include "source.h"
+#include "sse.h"
+#include "state.h"
+#include "ui.h"
+#include "utils.h"
 
-// only required when using a real serial port
-void setser(int fd) 
+std::string to_string(const std::vector<uint8_t> & bytes, const unsigned n)
 {
-	struct termios newtio;
-
-	if (tcgetattr(fd, &newtio) == -1)
-		error_exit(true, gettext("tcgetattr failed: did you select a powerbank serial port?"));
-
-	newtio.c_iflag = IGNBRK; // | ISTRIP;
-	newtio.c_oflag = 0;
-	newtio.c_cflag = B9600 | CS8 | CREAD | CLOCAL | CSTOPB;
-	newtio.c_lflag = 0;
-	newtio.c_cc[VMIN] = 1;
-	newtio.c_cc[VTIME] = 0;
+	std::string out;
 
-	if (tcsetattr(fd, TCSANOW, &newtio) == -1)
-		error_exit(true, gettext("tcsetattr failed: problem talking to serial port"));
+	for(unsigned i=0; i<n; i++)
+		out += char(bytes.at(i));
 
-	tcflush(fd, TCIOFLUSH);
+	return out;
 }
 
-bool ansi_terminal(void)
+std::string get_name(const int fd)
 {
-	const char *term = getenv("TERM");
-
-	if (!isatty(1) || !isatty(2))
-		return false;
+	drain(fd);
 
-	if (!term)
-		return false;
+	request(fd, CMD_GET_NAME);
 
-	if (strcasestr(term, "ansi") == 0)
-		return true;
+	std::vector<uint8_t> name_bytes = get_bytes(fd, 18);
 
-	if (strcasestr(term, "console") == 0 || strcasestr(term, "con80x25") == 0 || strcasestr(term, "linux") == 0)
-		return true;
+	return to_string(name_bytes, 16);
+}
 
-	if (strcasestr(term, "screen") == 0)
-		return true;
+std::string get_descr(const int fd)
+{
+	drain(fd);
 
-	if (strcasestr(term, "xterm") == 0)
-		return true;
+	request(fd, CMD_GET_DESCR);
 
-	if (strcasestr(term, "rxvt") == 0 || strcasestr(term, "konsole") == 0)
-		return true;
+	std::vector<uint8_t> descr_bytes = get_bytes(fd, 24);
 
-	return false;
+	return to_string(descr_bytes, 24);
 }
 
-void set_bold(bool on)
+void inc_hv(const int fd)
 {
-	if (ansi_terminal()) {
-		if (on)
-			fprintf(stderr, "\x1b[1m");
-		else
-			fprintf(stderr, "\x1b[22m");
-	}
+	request(fd, CMD_INC_HV);
 }
 
-void set_underline(bool on)
+void dec_hv(const int fd)
 {
-	if (ansi_terminal()) {
-		if (on)
-			fprintf(stderr, "\x1b[4m");
-		else
-			fprintf(stderr, "\x1b[24m");
-	}
+	request(fd, CMD_DEC_HV);
 }
 
-void reset_term()
+void set_hv(const int fd, const char *parameter)
 {
-	if (ansi_terminal())
-		fprintf(stderr, "\x1b[0m\x1b[2K\r");
+	if (!parameter)
+		error_exit(false, _("Parameter missing"));
+
+	if (strcasecmp(parameter, "on") == 0)
+		request(fd, CMD_HV_ON);
+	else
+		request(fd, CMD_HV_OFF);
 }
 
-void help_header(const char *str)
+void set_usb(const int fd, const char *parameter)
 {
-	fprintf(stderr, "\n");
-
-	set_bold(1);
-	fprintf(stderr, " *** ");
-
-	set_underline(1);
-	fprintf(stderr, "%s", str);
-	set_underline(0);
+	if (!parameter)
+		error_exit(false, _("Parameter missing"));
 
-	fprintf(stderr, " ***\n");
-	set_bold(0);
+	if (strcasecmp(parameter, "on") == 0)
+		request(fd, CMD_USB_ON);
+	else
+		request(fd, CMD_USB_OFF);
 }
 
-#define SWITCHES_COLUMN_WIDTH	24
-
-int max_x = 80, max_y = 24;
-
-void determine_terminal_size(void)
+void set_name(const int fd, const char *const name)
 {
-	struct winsize size;
+	char temp[17];
+	memset(temp, 0x00, sizeof(temp));
 
-	max_x = max_y = 0;
+	if (name) {
+		size_t l = strlen(name);
 
-	if (!isatty(1))
-	{
-		max_y = 24;
-		max_x = 80;
-	}
-#ifdef TIOCGWINSZ
-	else if (ioctl(1, TIOCGWINSZ, &size) == 0)
-	{
-		max_y = size.ws_row;
-		max_x = size.ws_col;
+		if (l > 16)
+			error_exit(false, _("Name too long"));
+
+		memcpy(temp, name, l);
 	}
-#endif
 
-	if (!max_x || !max_y)
-	{
-		char *dummy = getenv("COLUMNS");
-		if (dummy)
-			max_x = atoi(dummy);
-		else
-			max_x = 80;
+	request(fd, CMD_SET_NAME);
 
-		dummy = getenv("LINES");
-		if (dummy)
-			max_y = atoi(dummy);
-		else
-			max_y = 24;
-	}
+	if (write(fd, temp, 16) != 16)
+		error_exit(true, _("Error talking to power bank"));
 }
 
-void str_add(char **to, const char *what, ...)
+void set_bq24295(const int fd, const int idx, const char *parameter)
 {
-	int len_to = *to ? strlen(*to) : 0;
-	char *buffer = NULL;
-	int len_what = 0;
-
-	va_list ap;
-
-	va_start(ap, what);
-	len_what = vasprintf(&buffer, what, ap);
-	va_end(ap);
-
-	*to = (char *)realloc(*to, len_to + len_what + 1);
+	if (!parameter)
+		error_exit(false, _("Parameter missing"));
 
-	memcpy(&(*to)[len_to], buffer, len_what);
+	if (idx < 0 || idx > 9)
+		error_exit(false, _("Index out of range"));
 
-	(*to)[len_to + len_what] = 0x00;
+	uint8_t cmd[4];
+	bq24295_command(idx, atoi(parameter), cmd);
 
-	free(buffer);
+	if (write(fd, cmd, sizeof cmd) != sizeof cmd)
+		error_exit(true, _("Error talking to power bank"));
 }
 
-void format_help(const char *short_str, const char *long_str, const char *descr)
+void dump(const int fd, const bool json)
 {
-	int par_width = SWITCHES_COLUMN_WIDTH, max_wrap_width = par_width / 2, cur_par_width = 0;
-	int descr_width = max_x - (par_width + 1);
-	char *line = NULL, *p = (char *)descr;
-	char first = 1;
-
-	if (long_str && short_str)
-		str_add(&line, "%-4s / %s", short_str, long_str);
-	else if (long_str)
-		str_add(&line, "%s", long_str);
-	else if (short_str)
-		str_add(&line, "%s", short_str);
-	else
-		line = strdup("");
-
-	cur_par_width = fprintf(stderr, "%-*s ", par_width, line);
-
-	free(line);
-
-	if (par_width + 1 >= max_x || cur_par_width >= max_x) {
-		fprintf(stderr, "%s\n", descr);
-		return;
-	}
-
-	for(;strlen(p);) {
-		char *n =  NULL, *kn = NULL, *copy = NULL;
-		int len_after_ww = 0, len_before_ww = 0;
-		int str_len = 0, cur_descr_width = first ? max_x - cur_par_width : descr_width;
-
-		while(*p == ' ')
-			p++;
-
-		str_len = strlen(p);
-		if (!str_len)
-			break;
-
-		len_before_ww = std::min(str_len, cur_descr_width);
-
-		n = &p[len_before_ww];
-		kn = n;
-
-		if (str_len > cur_descr_width) { 
-			int n_len = 0;
-
-			while (*n != ' ' && n_len < max_wrap_width) {
-				n--;
-				n_len++;
-			}
-
-			if (n_len >= max_wrap_width)
-				n = kn;
-		}
+	const std::vector<uint8_t> state = get_state(fd);
 
-		len_after_ww = (int)(n - p);
-		if (len_after_ww <= 0)
-			break;
+	std::string name = get_name(fd);
 
-		copy = (char *)malloc(len_after_ww + 1);
-		memcpy(copy, p, len_after_ww);
-		copy[len_after_ww] = 0x00;
+	std::string descr = get_descr(fd);
 
-		if (first)
-			first = 0;
-		else
-			fprintf(stderr, "%*s ", par_width, "");
+	dump_state(name, descr, state, json);
+}
 
-		fprintf(stderr, "%s\n", copy);
+event_log *elog = NULL;
+anomaly_detector *detector = NULL;
 
-		free(copy);
+// set by the signal handler and by the consumer threads: a lock-free atomic is fine for both
+std::atomic<bool> stop(false);
 
-		p = n;
-	}
+void sigh(int)
+{
+	stop = true;
 }
 
-std::vector<uint8_t> get_bytes(const int fd, const unsigned n)
+// the only place where samples are read from the powerbank (or recording)
+void acquire(state_source *const src, sample_ring *const ring, const int interval)
 {
-	std::vector<uint8_t> out;
+	sample_t s;
 
-	struct pollfd fds[1] = { { fd, POLLIN, 0 } };
+	while(!stop && src->get(&s)) {
+		if (detector)
+			detector->check(s);
 
-	for(unsigned i=0; i<n; i++) {
-		fds[0].revents = 0;
+		if (elog)
+			elog->check(s);
 
-		int rc = poll(fds, 1, 100); // 100ms timeout
-		if (rc == -1)
-			error_exit(true, gettext("Poll on powerbank failed"));
-		if (rc == 0)
-			error_exit(true, gettext("Powerbank went silent"));
+		ring->publish(s);
 
-		uint8_t c = 0;
-		rc = read(fd, &c, 1);
-		if (rc <= 0)
-			error_exit(true, gettext("Problem receiving state from powerbank"));
-
-		out.push_back(c);
+		src->wait(interval * 1000ll);
 	}
 
-	return out;
+	ring->close();
 }
 
-void request(const int fd, const uint8_t cmd)
+void graph(sample_ring *const ring, ring_consumer *const c)
 {
-	if (write(fd, &cmd, 1) != 1)
-		error_exit(true, gettext("Problem sending command to powerbank"));
-}
+	determine_terminal_size();
 
-std::vector<uint8_t> get_state(const int fd)
-{
-	std::vector<uint8_t> out;
+	bool first = true;
+	int y = 0;
 
-retry:
-	request(fd, 0x70);
+	double scale_voltage = (max_x - 1) / 24.0, scale_current = (max_x - 1) / 3.0;
+	char line[max_x];
 
-	uint8_t buffer[51], *p = buffer;
+	for(;;) {
+		if (++y >= max_y - 3 || first) {
+			printf(_("| battery voltage, * charging current, + hv output current,\n"));
+			printf(_("- hv output voltage, # usb output current\n"));
 
-	struct pollfd fds[1] = { { fd, POLLIN, 0 } };
+			if (parser.get_stats().resyncs)
+				print_link_stats(stdout);
 
-	int todo = sizeof buffer;
-	for(; todo;) {
-		fds[0].revents = 0;
+			graph_scale(line, scale_voltage, scale_current);
 
-		int rc = poll(fds, 1, 100); // 100ms timeout
-		if (rc == -1)
-			error_exit(true, gettext("Poll on powerbank failed"));
-		if (rc == 0)
-			goto retry;
+			y = 0;
+			first = false;
+		}
 
-		rc = read(fd, p, todo);
-		if (rc <= 0)
-			error_exit(true, gettext("Problem receiving state from powerbank"));
+		sample_t s;
+		if (!ring->get(c, &s))
+			break;
 
-		p += rc;
-		todo -= rc;
+		graph_line(line, s.state, scale_voltage, scale_current);
 	}
 
-	for(unsigned i=0; i<sizeof(buffer); i++)
-		out.push_back(buffer[i]);
-
-	return out;
-}
-
-// celsius
-double get_temp(const std::vector<uint8_t> & state)
-{
-	int16_t v = state.at(0) | (state.at(1) << 8);
-
-	return v / 100.0;
-}
-
-double get_milli(const std::vector<uint8_t> & state, const int offset)
-{
-	int16_t v = state.at(offset + 0) | (state.at(offset + 1) << 8);
-
-	return v / 1000.0;
-}
-
-// mV
-double get_battery_voltage(const std::vector<uint8_t> & state)
-{
-	return get_milli(state, 2);
-}
-
-// mA
-double get_charging_current(const std::vector<uint8_t> & state)
-{
-	return get_milli(state, 4);
-}
-
-// mA
-double get_hv_output_current(const std::vector<uint8_t> & state)
-{
-	return get_milli(state, 6);
-}
-
-// mA
-double get_usb_output_current(const std::vector<uint8_t> & state)
-{
-	return get_milli(state, 8);
+	reset_term();
 }
 
-// mV
-double get_hv_output_voltage(const std::vector<uint8_t> & state)
+void exec(const char *script)
 {
-	return get_milli(state, 0x0a);
+	if (script)
+		system(script);
 }
 
-std::vector<uint8_t> get_i2c_BQ24295(const std::vector<uint8_t> & state)
+// power must be off for power_off_after seconds without interruption
+void ups(sample_ring *const ring, ring_consumer *const c, const unsigned power_off_after, const char *poweroff_script)
 {
-	std::vector<uint8_t> out;
+	bool unplugged = false;
+	uint64_t since = 0;
+	sample_t s;
 
-	for(int i=0x18; i<=0x21; i++)
-		out.push_back(state.at(i));
+	while(ring->get(c, &s)) {
+		if (get_charging_port_plugged_in(s.state)) {
+			unplugged = false;
+			continue;
+		}
 
-	return out;
-}
+		if (!unplugged) {
+			unplugged = true;
+			since = s.mono_us;
+		}
 
-uint8_t get_flags_0x22(const std::vector<uint8_t> & state)
-{
-	return state.at(0x22);
+		if (s.mono_us - since >= power_off_after * 1000000ull) {
+			exec(poweroff_script);
+			break;
+		}
+	}
 }
 
-bool get_auto_send_statemachine(const std::vector<uint8_t> & state)
+void shed(sample_ring *const ring, ring_consumer *const c, load_shedder *const ls)
 {
-	return get_flags_0x22(state) & 128;
-}
+	sample_t s;
 
-bool get_virtual_serial_port_connected(const std::vector<uint8_t> & state)
-{
-	return get_flags_0x22(state) & 64;
+	while(ring->get(c, &s))
+		ls->process(s);
 }
 
-bool get_charging_port_plugged_in(const std::vector<uint8_t> & state)
+void save_host(sample_ring *const ring, ring_consumer *const c, host_saver *const hs)
 {
-	return get_flags_0x22(state) & 32;
-}
+	sample_t s;
 
-bool get_warnings_enabled(const std::vector<uint8_t> & state)
-{
-	return get_flags_0x22(state) & 16;
+	while(ring->get(c, &s))
+		hs->process(s);
 }
 
-bool get_charger_fault(const std::vector<uint8_t> & state)
+void serve(sample_ring *const ring, ring_consumer *const c, sse_server *const sse)
 {
-	return get_flags_0x22(state) & 8;
-}
+	sample_t s;
 
-bool get_battery_overvoltage(const std::vector<uint8_t> & state)
-{
-	return get_flags_0x22(state) & 4;
+	while(ring->get(c, &s))
+		sse->publish(s);
 }
 
-bool get_battery_too_cold(const std::vector<uint8_t> & state)
+void govern(sample_ring *const ring, ring_consumer *const c, thermal_governor *const tg)
 {
-	return get_flags_0x22(state) & 2;
-}
+	sample_t s;
 
-bool get_battery_too_hot(const std::vector<uint8_t> & state)
-{
-	return get_flags_0x22(state) & 1;
+	while(ring->get(c, &s))
+		tg->process(s);
 }
 
-uint8_t get_flags_0x23(const std::vector<uint8_t> & state)
+void record(sample_ring *const ring, ring_consumer *const c, recorder *const r, archive_writer *const a)
 {
-	return state.at(0x23);
-}
+	sample_t s;
 
-//
-bool get_hv_output_on(const std::vector<uint8_t> & state)
-{
-	return get_flags_0x23(state) & 128;
-}
+	while(ring->get(c, &s)) {
+		if (r)
+			r->add(s);
 
-bool get_usb_output_on(const std::vector<uint8_t> & state)
-{
-	return get_flags_0x23(state) & 64;
+		if (a)
+			a->add(s);
+	}
 }
 
-uint32_t get_battery_uptime(const std::vector<uint8_t> & state)
+// consumers run in their own thread; when one of them is done, everything stops
+std::thread *start_consumer(sample_ring *const ring, ring_consumer *const c, std::function<void()> f)
 {
-	return (state.at(0x27) << 24) | (state.at(0x26) << 16) | (state.at(0x25) << 8) | state.at(0x24);
+	return start_thread([=]() { f(); ring->leave(c); stop = true; });
 }
 
-void json_double(const char *name, const double v, const bool next)
+// x[smhd], returns ms
+int64_t parse_duration(const char *const str)
 {
-	printf("\"%s\" : %f", name, v);
-
-	if (next)
-		printf(",\n");
-	else
-		printf("\n");
-}
+	char *end = NULL;
+	long v = strtol(str, &end, 10);
+	int mul = 1;
 
-void json_uint32_t(const char *name, const uint32_t v, const bool next)
-{
-	printf("\"%s\" : %u", name, v);
+	if (*end == 'm')
+		mul = 60;
+	else if (*end == 'h')
+		mul = 3600;
+	else if (*end == 'd')
+		mul = 86400;
+	else if ((*end != 's' && *end != 0x00) || end == str)
+		error_exit(false, _("%s is not a valid duration"), str);
 
-	if (next)
-		printf(",\n");
-	else
-		printf("\n");
+	return v * mul * 1000ll;
 }
 
-void json_bool(const char *name, const bool v, const bool next)
+// seconds since the epoch, "now", -x[smhd] (relative to now) or a local date/time; returns ms since the epoch
+int64_t parse_time(const char *const str)
 {
-	printf("\"%s\" : %s", name, v ? "true" : "false");
+	time_t now = time(NULL);
 
-	if (next)
-		printf(",\n");
-	else
-		printf("\n");
-}
+	if (strcasecmp(str, "now") == 0)
+		return now * 1000ll;
 
-std::string to_string(const std::vector<uint8_t> & bytes, const unsigned n)
-{
-	std::string out;
+	char *end = NULL;
 
-	for(unsigned i=0; i<n; i++)
-		out += char(bytes.at(i));
+	if (str[0] == '-')
+		return now * 1000ll - parse_duration(&str[1]);
 
-	return out;
-}
+	long long v = strtoll(str, &end, 10);
+	if (*end == 0x00)
+		return v * 1000ll;
 
-std::string get_name(const int fd)
-{
-	request(fd, 0x42);
+	const char *formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d", NULL };
 
-	std::vector<uint8_t> name_bytes = get_bytes(fd, 18);
+	for(int i=0; formats[i]; i++) {
+		struct tm tm;
+		memset(&tm, 0x00, sizeof tm);
 
-	return to_string(name_bytes, 16);
-}
+		const char *rest = strptime(str, formats[i], &tm);
+		if (rest && *rest == 0x00) {
+			tm.tm_isdst = -1;
 
-std::string get_descr(const int fd)
-{
-	request(fd, 0xff);
+			return mktime(&tm) * 1000ll;
+		}
+	}
 
-	std::vector<uint8_t> descr_bytes = get_bytes(fd, 24);
+	error_exit(false, _("%s is not a valid time"), str);
 
-	return to_string(descr_bytes, 24);
+	return 0;
 }
 
-void inc_hv(const int fd)
+std::string format_time(const int64_t t)
 {
-	request(fd, 0x73);
-}
+	time_t sec = t / 1000;
+	struct tm tm;
+	localtime_r(&sec, &tm);
 
-void dec_hv(const int fd)
-{
-	request(fd, 0x74);
-}
+	char buffer[32];
+	strftime(buffer, sizeof buffer, "%Y-%m-%d %H:%M:%S", &tm);
 
-void set_hv(const int fd, const char *parameter)
-{
-	if (!parameter)
-		error_exit(false, gettext("Parameter missing"));
+	char ms[8];
+	snprintf(ms, sizeof ms, ".%03d", int(t % 1000));
 
-	if (strcasecmp(parameter, "on") == 0)
-		request(fd, 0x77);
-	else
-		request(fd, 0x78);
+	return std::string(buffer) + ms;
 }
 
-void set_usb(const int fd, const char *parameter)
-{
-	if (!parameter)
-		error_exit(false, gettext("Parameter missing"));
+typedef struct {
+	bool list;
+	int measurement, flag;	// for rollups
+	uint64_t n;
+	double min, max, sum;
+	int64_t t_min, t_max;
+} query_t;
 
-	if (strcasecmp(parameter, "on") == 0)
-		request(fd, 0x75);
-	else
-		request(fd, 0x76);
-}
-
-void set_name(const int fd, const char *const name)
+void query_add(query_t *const q, const int64_t t, const double min, const double max, const double sum, const uint64_t n)
 {
-	char temp[17];
-	memset(temp, 0x00, sizeof(temp));
-
-	if (name) {
-		size_t l = strlen(name);
-
-		if (l > 16)
-			error_exit(false, gettext("Name too long"));
-
-		memcpy(temp, name, l);
+	if (q->n == 0 || min < q->min) {
+		q->min = min;
+		q->t_min = t;
 	}
 
-	request(fd, 0x43);
-
-	if (write(fd, temp, 16) != 16)
-		error_exit(true, gettext("Error talking to power bank"));
-}
-
-char to_hex(const int v)
-{
-	if (v <= 9)
-		return '0' + v;
+	if (q->n == 0 || max > q->max) {
+		q->max = max;
+		q->t_max = t;
+	}
 
-	return 'a' + v - 10;
+	q->sum += sum;
+	q->n += n;
 }
 
-void set_bq24295(const int fd, const int idx, const char *parameter)
+void query_cb(const int64_t t, const double v, void *arg)
 {
-	if (!parameter)
-		error_exit(false, gettext("Parameter missing"));
-
-	if (idx < 0 || idx > 9)
-		error_exit(false, gettext("Index out of range"));
+	query_t *q = (query_t *)arg;
 
-	unsigned p = atoi(parameter);
-
-	char cmd[4] = { 0x71, char('0' + idx), to_hex(p >> 4), to_hex(p & 15) };
-
-	if (write(fd, cmd, sizeof cmd) != sizeof cmd)
-		error_exit(true, gettext("Error talking to power bank"));
-}
-
-void json_string(const char *name, const std::string & v, const bool next)
-{
-	printf("\"%s\" : \"%s\"", name, v.c_str());
+	if (q->list)
+		printf("%s\t%f\n", format_time(t).c_str(), v);
 
-	if (next)
-		printf(",\n");
-	else
-		printf("\n");
+	query_add(q, t, v, v, v, 1);
 }
 
-void dump(const int fd, const bool json)
+void query_rollup_cb(const rollup_t & r, void *arg)
 {
-	const std::vector<uint8_t> state = get_state(fd);
-
-	std::string name = get_name(fd);
-
-	std::string descr = get_descr(fd);
-
-	if (json) {
-		printf("{\n");
-		json_string("name", name, true);
-		json_string("descr", descr, true);
-
-		json_double("battery-voltage", get_battery_voltage(state), true);
-		json_double("charging-current", get_charging_current(state), true);
-		json_double("HV-output-current", get_hv_output_current(state), true);
-		json_double("HV-output-voltage", get_hv_output_voltage(state), true);
-		json_double("USB-output-current", get_usb_output_current(state), true);
-		json_uint32_t("battery-uptime", get_battery_uptime(state), true);
+	query_t *q = (query_t *)arg;
 
-		std::vector<uint8_t> c = get_i2c_BQ24295(state);
-		for(unsigned i=0; i<unsigned(c.size()); i++) {
-			char *buffer = NULL;
-			asprintf(&buffer, "bq24295-reg-%u", i);
+	if (r.n == 0)
+		return;
 
-			json_uint32_t(buffer, c.at(i), true);
+	if (q->measurement != -1) {
+		int m = q->measurement;
+		double scale = measurements[m].scale;
 
-			free(buffer);
-		}
+		if (q->list)
+			printf("%s\t%f\t%f\t%f\t%f\n", format_time(r.t).c_str(), r.min[m] / scale, r.mean[m] / scale, r.max[m] / scale, r.last[m] / scale);
 
-		json_bool("battery-overvoltage", get_battery_overvoltage(state), true);
-		json_bool("auto-send-statemachine", get_auto_send_statemachine(state), true);
-		json_bool("virtual-serial-port-connected", get_virtual_serial_port_connected(state), true);
-		json_bool("charging-port-pluggend-in", get_charging_port_plugged_in(state), true);
-		json_bool("warnings-enabled", get_warnings_enabled(state), true);
-		json_bool("charger-fault", get_charger_fault(state), true);
-		json_bool("battery-too-cold", get_battery_too_cold(state), true);
-		json_bool("battery-too-hot", get_battery_too_hot(state), true);
-		json_bool("hv-output", get_hv_output_on(state), true);
-		json_bool("usb-output", get_usb_output_on(state), false);
-		printf("}\n");
+		query_add(q, r.t, r.min[m] / scale, r.max[m] / scale, r.mean[m] / scale * r.n, r.n);
 	}
 	else {
-		printf(gettext("name:\t%s\n"), name.c_str());
-		printf(gettext("descr:\t%s\n"), descr.c_str());
-
-		printf(gettext("temperature:\t%f degreese celsius\n"), get_temp(state));
-		printf(gettext("battery voltage:\t%f V\n"), get_battery_voltage(state));
-		printf(gettext("charging current:\t%f A\n"), get_charging_current(state));
-		printf(gettext("HV output current:\t%f A\n"), get_hv_output_current(state));
-		printf(gettext("HV output voltage:\t%f V\n"), get_hv_output_voltage(state));
-		printf(gettext("USB output current:\t%f A\n"), get_usb_output_current(state));
-		printf(gettext("Battery uptime:\t%u seconds\n"), get_battery_uptime(state));
-
-		printf(gettext("BQ24295 registers:\t"));
-		std::vector<uint8_t> c = get_i2c_BQ24295(state);
-		for(size_t i=0; i<c.size(); i++) {
-			if (i)
-				printf(" ");
-
-			printf("%02x", c.at(i));
-		}
-		printf("\n");
-
-		if (get_battery_overvoltage(state))
-			printf(gettext("Battery overvoltage!!\n"));
-		if (get_auto_send_statemachine(state))
-			printf(gettext("Statemachine is in auto send mode\n"));
-		if (get_virtual_serial_port_connected(state))
-			printf(gettext("Virtual serial port connected\n"));
-		if (get_charging_port_plugged_in(state))
-			printf(gettext("Charging port plugged in\n"));
-		if (get_warnings_enabled(state))
-			printf(gettext("Warnings enabled\n"));
-		if (get_charger_fault(state))
-			printf(gettext("Charger fault\n"));
-		if (get_battery_too_cold(state))
-			printf(gettext("Battery too cold!\n"));
-		if (get_battery_too_hot(state))
-			printf(gettext("Battery too hot!!!\n"));
-		if (get_hv_output_on(state))
-			printf(gettext("HV output on\n"));
-		if (get_usb_output_on(state))
-			printf(gettext("USB output on\n"));
-	}
-}
-
-void putChar(char *line, int x, const char *c, const bool red)
-{
-	if (x < 0)
-		x = 0;
-
-	if (x >= max_x)
-		x = max_x -1;
-
-	memcpy(&line[x], c, strlen(c));
+		// duty cycle
+		double v = double(r.flag_count[q->flag]) / r.n;
 
-	if (ansi_terminal()) {
-		fprintf(stderr, "\x1b[%dG", x + 1);
+		if (q->list)
+			printf("%s\t%f\n", format_time(r.t).c_str(), v);
 
-		if (red)
-			fprintf(stderr, "\x1b[31m");
-		else
-			fprintf(stderr, "\x1b[32m");
-
-		fprintf(stderr, "%s", c);
+		query_add(q, r.t, v, v, r.flag_count[q->flag], r.n);
 	}
 }
 
-void graph(const int fd, const char *parameter)
+// parameter: min, max, mean, count or list (default)
+// tier: raw, one of the rollups or NULL to select one from the length of the period
+void query(const char *const archive, const char *const field, const char *const from, const char *const to, const char *tier, const char *parameter)
 {
-	bool first = true;
-	int y = 0;
+	if (!archive)
+		error_exit(false, _("No archive selected (-A)"));
 
-	double scale_voltage = (max_x - 1) / 24.0, scale_current = (max_x - 1) / 3.0;
-	char line[max_x];
+	if (!field) {
+		std::vector<std::string> names = archive_column_names();
 
-	int interval = parameter ? atoi(parameter) : 200;
+		fprintf(stderr, _("Select a field (-F):"));
+		for(auto & name : names)
+			fprintf(stderr, " %s", name.c_str());
+		for(int i=0; flags[i].name; i++)
+			fprintf(stderr, " %s", flags[i].name);
+		fprintf(stderr, "\n");
 
-	for(;;) {
-		if (++y >= max_y - 3 || first) {
-			printf(gettext("| battery voltage, * charging current, + hv output current,\n"));
-			printf(gettext("- hv output voltage, # usb output current\n"));
-
-			memset(line, ' ', sizeof line);
-			line[max_x - 1] = 0x00;
-
-			putChar(line, int(scale_current * 1.0), "C1", true);
-			putChar(line, int(scale_current * 2.0), "C2", true);
-
-			putChar(line, int(scale_voltage * 3.0), "V3", false);
-			putChar(line, int(scale_voltage * 5.0), "V5", false);
-			putChar(line, int(scale_voltage * 10.0), "V10", false);
-			putChar(line, int(scale_voltage * 15.0), "V15", false);
-			putChar(line, int(scale_voltage * 20.0), "V20", false);
-
-			if (!ansi_terminal())
-				printf("%s\n", line);
-
-			y = 0;
-			first = false;
-		}
-
-		const std::vector<uint8_t> state = get_state(fd);
+		exit(1);
+	}
 
-		double battery_voltage = get_battery_voltage(state);
-		double charging_current = get_charging_current(state);
-		double hv_output_current = get_hv_output_current(state);
-		double hv_output_voltage = get_hv_output_voltage(state);
-		double usb_output_current = get_usb_output_current(state);
+	query_t q;
+	memset(&q, 0x00, sizeof q);
+	q.list = !parameter || strcasecmp(parameter, "list") == 0;
+	q.measurement = q.flag = -1;
 
-		memset(line, ' ', sizeof line);
-		line[max_x - 1] = 0x00;
+	for(int i=0; measurements[i].name; i++) {
+		if (strcasecmp(measurements[i].name, field) == 0)
+			q.measurement = i;
+	}
 
-		int x;
+	for(int i=0; flags[i].name; i++) {
+		if (strcasecmp(flags[i].name, field) == 0)
+			q.flag = i;
+	}
 
-		x = battery_voltage * scale_voltage;
-		putChar(line, x, "|", false);
+	int nr = archive_find_column(field);
+	if (nr == -1 && q.flag == -1)
+		error_exit(false, _("%s is not a known field"), field);
+
+	int64_t t_from = from ? parse_time(from) : 0;
+	int64_t t_to = to ? parse_time(to) : INT64_MAX;
+
+	if (!tier) {
+		std::vector<archive_index_t> index = archive_load_index(archive);
+		int64_t raw_start = index.empty() ? INT64_MAX : index.front().t_first;
+		int64_t raw_end = index.empty() ? INT64_MIN : index.back().t_last;
+		// without -B the period starts where the data starts
+		int64_t start = from ? t_from : raw_start;
+		int64_t range = std::min(t_to, raw_end) - std::max(start, raw_start);
+
+		if (nr != -1 && (q.measurement == -1 || (start >= raw_start && range <= 6 * 3600 * 1000ll)))
+			tier = "raw";
+		else if (range <= 14 * 86400 * 1000ll)
+			tier = rollup_tiers[0].suffix;
+		else
+			tier = rollup_tiers[1].suffix;
+	}
 
-		x = charging_current * scale_current;
-		putChar(line, x, "*", true);
+	if (strcasecmp(tier, "raw") == 0) {
+		if (nr == -1)
+			error_exit(false, _("%s is only available in the rollups (-t)"), field);
 
-		x = hv_output_current * scale_current;
-		putChar(line, x, "+", true);
+		archive_scan(archive, nr, t_from, t_to, query_cb, &q);
+	}
+	else {
+		bool found = false;
 
-		x = hv_output_voltage * scale_voltage;
-		putChar(line, x, "-", false);
+		for(int i=0; rollup_tiers[i].suffix; i++)
+			found |= strcmp(rollup_tiers[i].suffix, tier) == 0;
 
-		x = usb_output_current * scale_current;
-		putChar(line, x, "#", true);
+		if (!found)
+			error_exit(false, _("%s is not a known tier"), tier);
 
-		if (ansi_terminal())
-			fprintf(stderr, "\x1b[m\n");
-		else
-			printf("%s\n", line);
+		if (q.measurement == -1 && q.flag == -1)
+			error_exit(false, _("%s is not in the rollups, use -t raw"), field);
 
-		usleep(interval * 1000);
+		rollup_scan(archive, tier, t_from, t_to, query_rollup_cb, &q);
 	}
-}
 
-void exec(const char *script)
-{
-	if (script)
-		system(script);
-}
-
-void ups(const int fd, const unsigned power_off_after, const char *poweroff_script)
-{
-	bool p_off_trig = false;
-
-	for(;!p_off_trig;) {
-		std::vector<uint8_t> state = get_state(fd);
-
-		if (get_charging_port_plugged_in(state) == false) {
-			sleep(power_off_after);
+	if (q.list)
+		return;
 
-			state = get_state(fd);
-			if (get_charging_port_plugged_in(state) == false) {
-				p_off_trig = true;
-				exec(poweroff_script);
-			}
-		}
-	}
+	if (strcasecmp(parameter, "count") == 0)
+		printf("%llu\n", (unsigned long long)q.n);
+	else if (q.n == 0)
+		error_exit(false, _("No samples in this period"));
+	else if (strcasecmp(parameter, "min") == 0)
+		printf("%s\t%f\n", format_time(q.t_min).c_str(), q.min);
+	else if (strcasecmp(parameter, "max") == 0)
+		printf("%s\t%f\n", format_time(q.t_max).c_str(), q.max);
+	else if (strcasecmp(parameter, "mean") == 0)
+		printf("%f\n", q.sum / q.n);
+	else
+		error_exit(false, _("%s: use min, max, mean, count or list"), parameter);
 }
 
 void version()
@@ -788,43 +525,89 @@ void version()
 
 void help(void)
 {
+	determine_terminal_size();
+
 	fprintf(stderr, "\n");
 
 	/* where to connect to */
-	help_header(gettext("main"));
-	format_help("-d x", "--device", gettext("(virtual in case of USB -)serial device to which the powerbank is connected"));
-	format_help("-f", "--fork", gettext("fork into the background (become daemon)"));
-	format_help("-m", "--mode", gettext("mode of this tool: ups, dump, set-name, set-bq24295, set-usb, set-hv"));
-	format_help(NULL, NULL, gettext("- ups: shutdown system when power is off for a while (-D) using a user selected command (-s)"));
-	format_help(NULL, NULL, gettext("- graph: draw a graph (on the terminal) in realtime of all measurements. use -p to set an interval in ms."));
-	format_help(NULL, NULL, gettext("- dump: dump configuration & state of power bank"));
-	format_help(NULL, NULL, gettext("- set-name: configure name of bank"));
-	format_help(NULL, NULL, gettext("- set-bq24295: configure charger chip, see data-sheet at http://www.ti.com/lit/ds/symlink/bq24295.pdf"));
-	format_help(NULL, NULL, gettext("- set-usb: toggle state of USB power (-p: on/off)"));
-	format_help(NULL, NULL, gettext("- set-hv: toggle state of HV power (-p: on/off)"));
-	format_help(NULL, NULL, gettext("- inc-hv: increase HV voltage (in 64 steps)"));
-	format_help(NULL, NULL, gettext("- dec-hv: decrease HV voltage (in 64 steps)"));
-	format_help("-p", "--parameter", gettext("parameter (if any) for the command chosen"));
-
-	help_header(gettext("configuring bq24295"));
-	format_help("-i", "--index", gettext("index (if any) for the command chosen"));
-
-	help_header(gettext("ups mode"));
-	format_help("-D", "--power-off-after", gettext("how long to wait before shutdown after power loss"));
-	format_help("-s", "--shutdown-command", gettext("command to use to power down system (see -D and -m ups)"));
-
-	help_header(gettext("dump format"));
-	format_help("-j", "--json", gettext("JSON output for -m dump"));
-
-	help_header(gettext("meta"));
-	format_help("-V", "--version", gettext("get version of this program"));
-	format_help("-h", "--help", gettext("get this help"));
-}
-
-typedef enum { M_UPS, M_DUMP, M_GRAPH, M_SET_NAME, M_SET_bq24295, M_SET_USB, M_SET_HV, M_INC_HV, M_DEC_HV } pbc_mode_t;
+	help_header(_("main"));
+	format_help("-d x", "--device", _("(virtual in case of USB -)serial device to which the powerbank is connected"));
+	format_help("-b x", "--baud", _("serial line speed, default 9600. \"auto\" probes for the fastest rate at which the powerbank answers (skipped for USB virtual serial ports)"));
+	format_help("-f", "--fork", _("fork into the background (become daemon)"));
+	format_help("-m", "--mode", _("mode of this tool: ups, dump, set-name, set-bq24295, set-usb, set-hv"));
+	format_help(NULL, NULL, _("- ups: shutdown system when power is off for a while (-D) using a user selected command (-s)"));
+	format_help(NULL, NULL, _("- shed: when running on battery, switch off or reduce outputs following a plan (-P) and restore them when power returns. can also be combined with ups mode."));
+	format_help(NULL, NULL, _("- serve: stream the samples to any number of viewers as Server-Sent Events over HTTP, see -L. -p sets the interval in ms."));
+	format_help(NULL, NULL, _("- governor: lower the charge current of the bq24295 gradually when the battery gets hot, see -G."));
+	format_help(NULL, NULL, _("- graph: draw a graph (on the terminal) in realtime of all measurements. use -p to set an interval in ms."));
+	format_help(NULL, NULL, _("- dump: dump configuration & state of power bank"));
+	format_help(NULL, NULL, _("- events: log changes of the flags (power plugged in, outputs, faults) with a timestamp, see -e. -p sets the poll interval in ms."));
+	format_help(NULL, NULL, _("- record: store samples in a file (-o) for use with -r and/or in an archive (-A). -p sets the interval in ms (default 1000)."));
+	format_help(NULL, NULL, _("- query: get samples of one field (-F) from an archive (-A), optionally limited to a period (-B/-E). -p selects min, max, mean, count or list (default)."));
+	format_help(NULL, NULL, _("- set-name: configure name of bank"));
+	format_help(NULL, NULL, _("- set-bq24295: configure charger chip, see data-sheet at http://www.ti.com/lit/ds/symlink/bq24295.pdf"));
+	format_help(NULL, NULL, _("- set-usb: toggle state of USB power (-p: on/off)"));
+	format_help(NULL, NULL, _("- set-hv: toggle state of HV power (-p: on/off)"));
+	format_help(NULL, NULL, _("- inc-hv: increase HV voltage (in 64 steps)"));
+	format_help(NULL, NULL, _("- dec-hv: decrease HV voltage (in 64 steps)"));
+	format_help("-p", "--parameter", _("parameter (if any) for the command chosen"));
+
+	help_header(_("configuring bq24295"));
+	format_help("-i", "--index", _("index (if any) for the command chosen"));
+
+	help_header(_("ups mode"));
+	format_help("-D", "--power-off-after", _("how long to wait before shutdown after power loss"));
+	format_help("-s", "--shutdown-command", _("command to use to power down system (see -D and -m ups)"));
+
+	help_header(_("load shedding"));
+	format_help("-P x", "--shed-plan", _("comma separated list of usb (USB off), hv (HV off) or hv-down:n (lower HV voltage n steps), in the order in which they're applied. each can be followed by @voltage: only apply when the battery voltage dropped to this value. e.g. usb,hv-down:8@3.6,hv@3.4"));
+
+	help_header(_("host power-saving"));
+	format_help("-H x", "--host-plan", _("while on battery (ups and shed mode), throttle this system following a comma separated list of governor:name (cpufreq governor), max-freq:x (maximum cpu frequency in kHz or x% of the maximum) or cpu:slice=x (limit cgroup slice to x% of one cpu), in the order in which they're applied. each can be followed by @voltage like with -P. the settings are restored when power returns. e.g. governor:powersave,cpu:background.slice=20,max-freq:50%@3.6"));
+	format_help("-S x", "--sysfs-root", _("where sysfs is mounted, default /sys"));
+	format_help("-C x", "--cgroup-root", _("where the cgroup (v2) hierarchy is mounted, default /sys/fs/cgroup"));
+
+	help_header(_("thermal governor"));
+	format_help("-G x", "--governor", _("comma separated key=value settings: min and max fast charge current (mA, default 512 and 2048), input (input current limit in mA at full charge current, default 2000; only touched while the charge current is lowered, never above what the bank had), cold, soft and hard (temperatures in C, default 5, 40 and 50: full current up to soft, minimum from hard) and interval (minimum seconds after a register write before a value is raised again, default 10; lowering is immediate)"));
+
+	help_header(_("event stream server"));
+	format_help("-L x", "--listen", _("[address:]port (a numeric IPv4 or IPv6 address or localhost, which is the default) or path of a unix domain socket to serve the samples on as Server-Sent Events, at /events. e.g. curl -N http://localhost:8080/events. works in all modes that read samples, clients that can't keep up lose samples and are disconnected when they fall too far behind"));
+	format_help("-O x", "--allow-origin", _("send an Access-Control-Allow-Origin header with this value to -L clients, e.g. http://localhost:3000 or *. default is none: browsers only allow pages from the same origin"));
+
+	help_header(_("replay"));
+	format_help("-o x", "--output", _("file to write to (-m record)"));
+	format_help("-r x", "--replay", _("read samples from a recording instead of the powerbank. works with ups, shed, governor, serve, graph, events and record mode. commands are not sent and host settings (-H) are only printed, the shutdown command (-s) is executed!"));
+	format_help("-R x", "--replay-speed", _("replay speed relative to realtime, e.g. 10 for 10x faster. 0 is as fast as possible. default is 1."));
+
+	help_header(_("archive"));
+	format_help("-A x", "--archive", _("compressed archive of samples, written by -m record, read by -m query"));
+	format_help("-F x", "--field", _("field to query, e.g. HV-output-current. leave out for a list"));
+	format_help("-B x", "--begin", _("start of period: seconds since 1970, \"now\", -x[smhd] for x seconds/minutes/hours/days ago or a local \"YYYY-mm-dd [HH:MM[:SS]]\""));
+	format_help("-E x", "--end", _("end of period, see -B"));
+	format_help("-t x", "--tier", _("resolution to query: raw, 1m or 1h. the rollups have min/mean/max/last of the measurements and the duty cycle of the flags. selected from the length of the period when left out"));
+	format_help("-K x", "--retain-raw", _("remove raw samples older than x[smhd] from the archive, the 1m/1h rollups are kept"));
+
+	help_header(_("event log"));
+	format_help("-e x", "--event-log", _("append flag changes and anomalies (-a) as JSON lines to this file, \"-\" for stdout or \"syslog\" for syslog/the journal. works in all modes that read samples"));
+	format_help("-X x", "--event-hook", _("shell command to run for each event, with PBC_EVENT (name), PBC_STATE (on/off), PBC_TIME (ms since 1970) and for anomalies PBC_VALUE in the environment. runs one at a time, in the background"));
+	format_help("-a x", "--anomaly", _("detect drifts before the powerbank flags a fault: all or a comma separated list of resistance (battery internal resistance from the voltage sag at load steps), charge-temperature (charging current relative to the temperature dropping) and hv-ripple (HV output voltage deviating from its set point). each can be followed by =x for the threshold (CUSUM, in standard deviations, default 5). alerts are events, see -e and -X"));
+
+	help_header(_("dump format"));
+	format_help("-j", "--json", _("JSON output for -m dump"));
+
+	help_header(_("meta"));
+	format_help("-T", "--timing", _("show how long it took from the start of main() (so without loading the program) until the command was sent/completed"));
+	format_help("-V", "--version", _("get version of this program"));
+	format_help("-h", "--help", _("get this help"));
+}
+
+typedef enum { M_UPS, M_SHED, M_GOVERNOR, M_SERVE, M_DUMP, M_EVENTS, M_RECORD, M_QUERY, M_GRAPH, M_SET_NAME, M_SET_bq24295, M_SET_USB, M_SET_HV, M_INC_HV, M_DEC_HV } pbc_mode_t;
 
 int main(int argc, char *argv[])
 {
+	// for -T: loading and static initialization are not included
+	const uint64_t t_start = get_us(CLOCK_MONOTONIC);
+
 	bool do_fork = false, json = false;
 	const char *dev = "/dev/ttyACM0";
 	pbc_mode_t m = M_DUMP;
@@ -832,36 +615,67 @@ int main(int argc, char *argv[])
 	const char *poweroff_script = "/sbin/poweroff";
 	const char *parameter = NULL;
 	int idx = -1;
-
-	determine_terminal_size();
-
-	setlocale(LC_ALL, "");
-	bindtextdomain("powerbankcontrol", "/usr/share/locale");
-	textdomain("powerbankcontrol");
+	int baudrate = DEFAULT_BAUDRATE;
+	const char *event_log_target = NULL, *event_hook = NULL, *anomaly_config = NULL;
+	bool timing = false;
+	const char *output_file = NULL, *replay_file = NULL;
+	const char *archive_file = NULL, *field = NULL, *from = NULL, *to = NULL, *tier = NULL;
+	int64_t retain = 0;
+	const char *shed_plan = NULL, *governor_config = NULL, *listen_on = NULL, *allow_origin = NULL;
+	const char *host_plan = NULL, *sysfs_root = "/sys", *cgroup_root = "/sys/fs/cgroup";
+	double replay_speed = 1.0;
 
 	static struct option long_options[] =
 	{
 		{"device",   	1, NULL, 'd' },
+		{"baud",   	1, NULL, 'b' },
 		{"fork",	0, NULL, 'f' },
 		{"mode",	0, NULL, 'm' },
 		{"power-off-after",	1, NULL, 'D' },
 		{"shutdown-command",	1, NULL, 's' },
+		{"event-log",	1, NULL, 'e' },
+		{"event-hook",	1, NULL, 'X' },
+		{"anomaly",	1, NULL, 'a' },
 		{"json",   	0, NULL, 'j' },
 		{"parameter",  	0, NULL, 'p' },
 		{"index",  	0, NULL, 'i' },
+		{"output",	1, NULL, 'o' },
+		{"replay",	1, NULL, 'r' },
+		{"replay-speed",	1, NULL, 'R' },
+		{"archive",	1, NULL, 'A' },
+		{"field",	1, NULL, 'F' },
+		{"begin",	1, NULL, 'B' },
+		{"end",		1, NULL, 'E' },
+		{"tier",	1, NULL, 't' },
+		{"retain-raw",	1, NULL, 'K' },
+		{"shed-plan",	1, NULL, 'P' },
+		{"host-plan",	1, NULL, 'H' },
+		{"sysfs-root",	1, NULL, 'S' },
+		{"cgroup-root",	1, NULL, 'C' },
+		{"governor",	1, NULL, 'G' },
+		{"listen",	1, NULL, 'L' },
+		{"allow-origin",	1, NULL, 'O' },
+		{"timing",	0, NULL, 'T' },
 		{"version",	0, NULL, 'V' },
 		{"help",	0, NULL, 'h' },
 		{NULL,		0, NULL, 0   }
 	};
 
 	int c = -1;
-	while((c = getopt_long(argc, argv, "d:fm:D:s:jp:i:Vh", long_options, NULL)) != -1)
+	while((c = getopt_long(argc, argv, "d:b:fm:D:s:e:jp:i:o:r:R:A:F:B:E:t:K:P:H:S:C:G:L:O:X:a:TVh", long_options, NULL)) != -1)
 	{
 		switch(c) {
 			case 'd':
 				dev = optarg;
 				break;
 
+			case 'b':
+				if (strcasecmp(optarg, "auto") == 0)
+					baudrate = 0;
+				else if ((baudrate = atoi(optarg)) <= 0)
+					error_exit(false, _("%s is not a valid baud rate"), optarg);
+				break;
+
 			case 'f':
 				do_fork = true;
 				break;
@@ -869,10 +683,22 @@ int main(int argc, char *argv[])
 			case 'm':
 				if (strcasecmp(optarg, "dump") == 0)
 					m = M_DUMP;
+				else if (strcasecmp(optarg, "events") == 0)
+					m = M_EVENTS;
+				else if (strcasecmp(optarg, "record") == 0)
+					m = M_RECORD;
+				else if (strcasecmp(optarg, "query") == 0)
+					m = M_QUERY;
 				else if (strcasecmp(optarg, "graph") == 0)
 					m = M_GRAPH;
 				else if (strcasecmp(optarg, "ups") == 0)
 					m = M_UPS;
+				else if (strcasecmp(optarg, "shed") == 0)
+					m = M_SHED;
+				else if (strcasecmp(optarg, "serve") == 0)
+					m = M_SERVE;
+				else if (strcasecmp(optarg, "governor") == 0)
+					m = M_GOVERNOR;
 				else if (strcasecmp(optarg, "set-name") == 0)
 					m = M_SET_NAME;
 				else if (strcasecmp(optarg, "set-bq24295") == 0)
@@ -886,7 +712,7 @@ int main(int argc, char *argv[])
 				else if (strcasecmp(optarg, "dec-hv") == 0)
 					m = M_DEC_HV;
 				else
-					error_exit(false, gettext("%s is an unknown mode"), optarg);
+					error_exit(false, _("%s is an unknown mode"), optarg);
 				break;
 
 			case 'D':
@@ -897,6 +723,18 @@ int main(int argc, char *argv[])
 				poweroff_script = optarg;
 				break;
 
+			case 'e':
+				event_log_target = optarg;
+				break;
+
+			case 'X':
+				event_hook = optarg;
+				break;
+
+			case 'a':
+				anomaly_config = optarg;
+				break;
+
 			case 'j':
 				json = true;
 				break;
@@ -909,6 +747,74 @@ int main(int argc, char *argv[])
 				idx = atoi(optarg);
 				break;
 
+			case 'o':
+				output_file = optarg;
+				break;
+
+			case 'r':
+				replay_file = optarg;
+				break;
+
+			case 'R':
+				replay_speed = atof(optarg);
+				break;
+
+			case 'A':
+				archive_file = optarg;
+				break;
+
+			case 'F':
+				field = optarg;
+				break;
+
+			case 'B':
+				from = optarg;
+				break;
+
+			case 'E':
+				to = optarg;
+				break;
+
+			case 't':
+				tier = optarg;
+				break;
+
+			case 'K':
+				retain = parse_duration(optarg);
+				break;
+
+			case 'P':
+				shed_plan = optarg;
+				break;
+
+			case 'H':
+				host_plan = optarg;
+				break;
+
+			case 'S':
+				sysfs_root = optarg;
+				break;
+
+			case 'C':
+				cgroup_root = optarg;
+				break;
+
+			case 'L':
+				listen_on = optarg;
+				break;
+
+			case 'O':
+				allow_origin = optarg;
+				break;
+
+			case 'G':
+				governor_config = optarg;
+				break;
+
+			case 'T':
+				timing = true;
+				break;
+
 			case 'V':
 				version();
 				return 0;
@@ -923,22 +829,160 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	int fd = open(dev, O_RDWR);
-	if (fd == -1)
-		error_exit(true, gettext("Failed opening %s"), dev);
+	// doesn't need the powerbank
+	if (m == M_QUERY) {
+		query(archive_file, field, from, to, tier, parameter);
+
+		return 0;
+	}
+
+	// these only send a command and never read a reply
+	bool one_shot = m == M_SET_NAME || m == M_SET_bq24295 || m == M_SET_HV || m == M_SET_USB || m == M_INC_HV || m == M_DEC_HV;
+
+	// these read samples until stopped
+	bool streaming = m == M_EVENTS || m == M_RECORD || m == M_GRAPH || m == M_UPS || m == M_SHED || m == M_GOVERNOR || m == M_SERVE;
+
+	// before any thread starts
+	if (streaming)
+		i18n_init();
+
+	if (m == M_SERVE && !listen_on)
+		error_exit(false, _("Nothing to listen on selected (-L)"));
+
+	if (anomaly_config && (!streaming || (!event_log_target && !event_hook && m != M_EVENTS)))
+		error_exit(false, _("Anomaly detection (-a) needs a mode that reads samples and an event log (-e) and/or hook (-X)"));
+
+	int fd = -1;
+	state_source *src = NULL;
+
+	if (replay_file) {
+		if (!streaming)
+			error_exit(false, _("This mode can't be used with a replay (-r)"));
+
+		if (do_fork && daemon(0, 0) == -1)
+			error_exit(true, _("Failed forking into the background"));
+
+		src = new replay_source(replay_file, replay_speed);
+	}
+	else {
+		fd = open(dev, O_RDWR | O_NOCTTY | O_CLOEXEC);
+		if (fd == -1)
+			error_exit(true, _("Failed opening %s"), dev);
+
+		if (ioctl(fd, TIOCEXCL) == -1)
+			error_exit(true, _("Failed locking %s"), dev);
+
+		if (do_fork && daemon(0, 0) == -1)
+			error_exit(true, _("Failed forking into the background"));
+
+		if (baudrate == 0) {
+			baudrate = probe_baudrate(fd, dev);
+
+			if (!do_fork)
+				fprintf(stderr, _("Using %d baud\n"), baudrate);
+		}
+		else if (!setser(fd, baudrate, !one_shot)) {
+			error_exit(true, _("%d baud is not supported by %s"), baudrate, dev);
+		}
+
+		src = new tty_source(fd, &stop);
+	}
+
+	if (m == M_EVENTS && !event_log_target)
+		event_log_target = "-";
+
+	if (event_log_target || event_hook)
+		elog = new event_log(event_log_target, event_hook);
 
-	if (ioctl(fd, TIOCEXCL) == -1)
-		error_exit(true, gettext("Failed locking %s"), dev);
+	if (anomaly_config)
+		detector = new anomaly_detector(elog, anomaly_config);
 
-	if (do_fork && daemon(0, 0) == -1)
-		error_exit(true, gettext("Failed forking into the background"));
+	signal(SIGINT, sigh);
+	signal(SIGTERM, sigh);
 
-	setser(fd);
+	if (streaming) {
+		if (m == M_RECORD && !output_file && !archive_file)
+			error_exit(false, _("No file selected (-o and/or -A)"));
+
+		if (m == M_SHED && !shed_plan && !host_plan)
+			error_exit(false, _("No shed plan selected (-P and/or -H)"));
+
+		int interval = parameter ? atoi(parameter) : (m == M_RECORD ? 1000 : 200);
+
+		// a replay waits for the slowest consumer instead of skipping samples
+		sample_ring ring(!src->is_live());
+		std::vector<std::thread *> threads;
+
+		recorder *r = output_file ? new recorder(output_file) : NULL;
+		archive_writer *a = archive_file ? new archive_writer(archive_file, retain) : NULL;
+
+		if (r || a) {
+			ring_consumer *c = ring.add_consumer("recorder");
+			threads.push_back(start_consumer(&ring, c, [&ring, c, r, a]() { record(&ring, c, r, a); }));
+		}
+
+		sse_server *sse = listen_on ? new sse_server(listen_on, allow_origin) : NULL;
+
+		if (sse) {
+			ring_consumer *c = ring.add_consumer("server");
+			threads.push_back(start_consumer(&ring, c, [&ring, c, sse]() { serve(&ring, c, sse); }));
+		}
+
+		if (m == M_GRAPH) {
+			ring_consumer *c = ring.add_consumer("graph");
+			threads.push_back(start_consumer(&ring, c, [&ring, c]() { graph(&ring, c); }));
+		}
+		else if (m == M_UPS) {
+			ring_consumer *c = ring.add_consumer("ups");
+			threads.push_back(start_consumer(&ring, c, [&ring, c, power_off_after, poweroff_script]() { ups(&ring, c, power_off_after, poweroff_script); }));
+		}
 
-	if (m == M_DUMP)
+		load_shedder *ls = shed_plan && (m == M_UPS || m == M_SHED) ? new load_shedder(src, shed_plan) : NULL;
+
+		if (ls) {
+			ring_consumer *c = ring.add_consumer("shed");
+			threads.push_back(start_consumer(&ring, c, [&ring, c, ls]() { shed(&ring, c, ls); }));
+		}
+
+		host_saver *hs = host_plan && (m == M_UPS || m == M_SHED) ? new host_saver(host_plan, sysfs_root, cgroup_root, !src->is_live()) : NULL;
+
+		if (hs) {
+			ring_consumer *c = ring.add_consumer("host");
+			threads.push_back(start_consumer(&ring, c, [&ring, c, hs]() { save_host(&ring, c, hs); }));
+		}
+
+		thermal_governor *tg = m == M_GOVERNOR ? new thermal_governor(src, governor_config) : NULL;
+
+		if (tg) {
+			ring_consumer *c = ring.add_consumer("governor");
+			threads.push_back(start_consumer(&ring, c, [&ring, c, tg]() { govern(&ring, c, tg); }));
+		}
+
+		// acquisition gets a thread of its own so that the main thread can handle signals
+		std::thread *th = start_thread([src, &ring, interval]() { acquire(src, &ring, interval); });
+
+		th->join();
+		delete th;
+
+		for(auto & t : threads) {
+			t->join();
+			delete t;
+		}
+
+		delete tg;
+		delete sse;
+		delete hs;
+		delete ls;
+		delete a;
+		delete r;
+
+		for(auto & c : ring.get_consumers()) {
+			if (c->overruns)
+				fprintf(stderr, _("%s: %llu samples, %llu skipped (too slow)\n"), c->name.c_str(), (unsigned long long)c->received, (unsigned long long)c->overruns);
+		}
+	}
+	else if (m == M_DUMP)
 		dump(fd, json);
-	else if (m == M_GRAPH)
-		graph(fd, parameter);
 	else if (m == M_SET_NAME)
 		set_name(fd, parameter);
 	else if (m == M_SET_bq24295)
@@ -951,8 +995,22 @@ int main(int argc, char *argv[])
 		inc_hv(fd);
 	else if (m == M_DEC_HV)
 		dec_hv(fd);
-	else if (m == M_UPS)
-		ups(fd, power_off_after, poweroff_script);
+
+	if (timing)
+		fprintf(stderr, _("done %.3f ms after the start of main()\n"), (get_us(CLOCK_MONOTONIC) - t_start) / 1000.0);
+
+	delete detector;
+
+	if (elog) {
+		elog->finish();
+
+		if (elog->get_dropped())
+			fprintf(stderr, _("%llu events dropped (event log or hook too slow)\n"), (unsigned long long)elog->get_dropped());
+
+		delete elog;
+	}
+
+	delete src;
 
 	return 0;
 }
@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <string.h>
+
+#include "ring.h"
+
+sample_ring::sample_ring(const bool lossless) : head(0), closed(false), lossless(lossless), consumers_waiting(0), producer_waiting(false)
+{
+	for(int i=0; i<RING_SIZE; i++) {
+		slots[i].seq = 0;
+
+		for(int w=0; w<RING_SLOT_WORDS; w++)
+			slots[i].words[w] = 0;
+	}
+}
+
+sample_ring::~sample_ring()
+{
+	for(auto & c : consumers)
+		delete c;
+}
+
+ring_consumer *sample_ring::add_consumer(const std::string & name)
+{
+	ring_consumer *c = new ring_consumer(name);
+
+	consumers.push_back(c);
+
+	return c;
+}
+
+uint64_t sample_ring::slowest()
+{
+	uint64_t s = head;
+
+	for(auto & c : consumers) {
+		if (!c->done)
+			s = std::min(s, c->next.load());
+	}
+
+	return s;
+}
+
+void sample_ring::wake_up()
+{
+	std::unique_lock<std::mutex> lck(lock);
+	cv.notify_all();
+}
+
+void sample_ring::leave(ring_consumer *const c)
+{
+	c->done = true;
+
+	wake_up();
+}
+
+// the sleepers and the wakers both use sequentially consistent operations
+// on the counters and on head/next: either the sleeper sees the change it
+// waits for, or the waker sees the sleeper and notifies under the lock
+void sample_ring::publish(const sample_t & s)
+{
+	uint64_t pos = head.load(std::memory_order_relaxed);
+
+	if (lossless && pos - slowest() >= RING_SIZE) {
+		std::unique_lock<std::mutex> lck(lock);
+
+		producer_waiting = true;
+
+		while(pos - slowest() >= RING_SIZE)
+			cv.wait(lck);
+
+		producer_waiting = false;
+	}
+
+	ring_slot_t & slot = slots[pos & (RING_SIZE - 1)];
+
+	uint64_t words[RING_SLOT_WORDS] = { s.mono_us, s.wall_us };
+	memcpy(&words[2], s.state.data(), STATE_FRAME_SIZE);
+
+	slot.seq.store(pos * 2 + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	for(int w=0; w<RING_SLOT_WORDS; w++)
+		slot.words[w].store(words[w], std::memory_order_relaxed);
+
+	slot.seq.store(pos * 2 + 2, std::memory_order_release);
+
+	head.store(pos + 1);
+
+	if (consumers_waiting > 0)
+		wake_up();
+}
+
+void sample_ring::close()
+{
+	closed = true;
+
+	wake_up();
+}
+
+bool sample_ring::get(ring_consumer *const c, sample_t *const s)
+{
+	for(;;) {
+		uint64_t next = c->next.load(std::memory_order_relaxed);
+		uint64_t h = head.load(std::memory_order_acquire);
+
+		if (next == h) {
+			if (closed)
+				return false;
+
+			std::unique_lock<std::mutex> lck(lock);
+
+			consumers_waiting++;
+
+			while(next == head.load() && !closed)
+				cv.wait(lck);
+
+			consumers_waiting--;
+
+			continue;
+		}
+
+		// fell behind: skip what was overwritten
+		if (h - next > RING_SIZE) {
+			c->overruns += h - next - RING_SIZE;
+			next = h - RING_SIZE;
+		}
+
+		const ring_slot_t & slot = slots[next & (RING_SIZE - 1)];
+
+		uint64_t seq = slot.seq.load(std::memory_order_acquire);
+
+		if (seq == next * 2 + 2) {
+			uint64_t words[RING_SLOT_WORDS];
+
+			for(int w=0; w<RING_SLOT_WORDS; w++)
+				words[w] = slot.words[w].load(std::memory_order_relaxed);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			// still the same sample? else the producer lapped us while copying
+			if (slot.seq.load(std::memory_order_relaxed) == seq) {
+				s->mono_us = words[0];
+				s->wall_us = words[1];
+
+				const uint8_t *const state = (const uint8_t *)&words[2];
+				s->state.assign(state, state + STATE_FRAME_SIZE);
+
+				c->next.store(next + 1);
+				c->received++;
+
+				if (lossless && producer_waiting)
+					wake_up();
+
+				return true;
+			}
+		}
+
+		c->overruns++;
+		c->next.store(next + 1);
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "state.h"
+
+// must be a power of 2
+#define RING_SIZE	256
+
+// mono_us, wall_us and the state frame
+#define RING_SLOT_WORDS	(2 + (STATE_FRAME_SIZE + 7) / 8)
+
+// the payload is read while it may be overwritten (the seqlock then tells
+// the reader to throw it away), so it's stored in atomic words: plain
+// memory would be a data race
+typedef struct {
+	std::atomic<uint64_t> seq;	// odd while being written
+	std::atomic<uint64_t> words[RING_SLOT_WORDS];
+} ring_slot_t;
+
+class ring_consumer
+{
+public:
+	const std::string name;
+
+	std::atomic<uint64_t> next;	// sequence number of the next sample to read
+	std::atomic<uint64_t> received, overruns;
+	std::atomic<bool> done;
+
+	ring_consumer(const std::string & name) : name(name), next(0), received(0), overruns(0), done(false) { }
+};
+
+// Single producer, multiple consumer broadcast ring: every consumer sees
+// every sample unless it falls more than RING_SIZE samples behind, then
+// the oldest ones are skipped and counted as overruns. The producer never
+// waits for consumers, unless lossless is set (for replays).
+class sample_ring
+{
+private:
+	ring_slot_t slots[RING_SIZE];
+	std::atomic<uint64_t> head;
+	std::atomic<bool> closed;
+	const bool lossless;
+
+	std::vector<ring_consumer *> consumers;
+
+	// only for sleeping/waking up, the data path is lock-free. the lock is
+	// only taken for a notify when the counters say someone is sleeping
+	std::mutex lock;
+	std::condition_variable cv;
+	std::atomic<int> consumers_waiting;
+	std::atomic<bool> producer_waiting;
+
+	void wake_up();
+
+	uint64_t slowest();
+
+public:
+	sample_ring(const bool lossless);
+	virtual ~sample_ring();
+
+	// all consumers must be added before the first publish()
+	ring_consumer *add_consumer(const std::string & name);
+	const std::vector<ring_consumer *> & get_consumers() const { return consumers; }
+
+	// a consumer that stops reading must leave, else a lossless ring waits for it forever
+	void leave(ring_consumer *const c);
+
+	void publish(const sample_t & s);
+	void close();
+
+	// blocks until there's a sample, false when the ring is closed and empty
+	bool get(ring_consumer *const c, sample_t *const s);
+};
@@ -0,0 +1,172 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "error.h"
+#include "i18n.h"
+#include "rollup.h"
+#include "state.h"
+
+const rollup_tier_t rollup_tiers[] = {
+	{ "1m", 60 * 1000 },
+	{ "1h", 3600 * 1000 },
+	{ NULL, 0 }
+};
+
+rollup_tier::rollup_tier(const std::string & archive, const char *const suffix, const int64_t period) : file(archive + "." + suffix), period(period), active(false), resumed(false)
+{
+	fd = open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1)
+		error_exit(true, _("Failed opening %s"), file.c_str());
+
+	// cut off a partially written record
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		error_exit(true, _("Failed opening %s"), file.c_str());
+
+	if (st.st_size % sizeof(rollup_t) && ftruncate(fd, st.st_size - st.st_size % sizeof(rollup_t)) == -1)
+		error_exit(true, _("Problem writing to %s"), file.c_str());
+}
+
+rollup_tier::~rollup_tier()
+{
+	if (active)
+		write_cur();
+
+	close(fd);
+}
+
+void rollup_tier::write_cur()
+{
+	for(int i=0; i<N_MEASUREMENTS; i++)
+		cur.mean[i] = lround(sum[i] / cur.n);
+
+	off_t end = lseek(fd, 0, SEEK_END);
+
+	if (pwrite(fd, &cur, sizeof cur, end) != sizeof cur)
+		error_exit(true, _("Problem writing to %s"), file.c_str());
+}
+
+void rollup_tier::add(const sample_t & s)
+{
+	int64_t t = s.wall_us / 1000;
+	int64_t start = t - t % period;
+
+	if (!active && !resumed) {
+		resumed = true;
+
+		// the previous run stopped halfway this period? then continue with it
+		off_t end = lseek(fd, 0, SEEK_END);
+		rollup_t last;
+
+		if (end >= off_t(sizeof last) && pread(fd, &last, sizeof last, end - sizeof last) == sizeof last && last.t == start) {
+			if (ftruncate(fd, end - sizeof last) == -1)
+				error_exit(true, _("Problem writing to %s"), file.c_str());
+
+			cur = last;
+
+			for(int i=0; i<N_MEASUREMENTS; i++)
+				sum[i] = double(cur.mean[i]) * cur.n;
+
+			active = true;
+		}
+	}
+
+	if (active && start != cur.t) {
+		write_cur();
+
+		active = false;
+	}
+
+	if (!active) {
+		memset(&cur, 0x00, sizeof cur);
+		cur.t = start;
+
+		for(int i=0; i<N_MEASUREMENTS; i++) {
+			cur.min[i] = INT16_MAX;
+			cur.max[i] = INT16_MIN;
+			sum[i] = 0.;
+		}
+
+		active = true;
+	}
+
+	for(int i=0; i<N_MEASUREMENTS; i++) {
+		int16_t v = get_raw(measurements[i], s.state);
+
+		if (v < cur.min[i])
+			cur.min[i] = v;
+
+		if (v > cur.max[i])
+			cur.max[i] = v;
+
+		sum[i] += v;
+		cur.last[i] = v;
+	}
+
+	for(int i=0; i<N_FLAGS; i++) {
+		if (s.state.at(flags[i].offset) & flags[i].mask)
+			cur.flag_count[i]++;
+	}
+
+	cur.n++;
+}
+
+void rollup_scan(const std::string & archive, const char *const suffix, const int64_t t_from, const int64_t t_to, void (*cb)(const rollup_t & r, void *arg), void *arg)
+{
+	int64_t period = 0;
+
+	for(int i=0; rollup_tiers[i].suffix; i++) {
+		if (strcmp(rollup_tiers[i].suffix, suffix) == 0)
+			period = rollup_tiers[i].period;
+	}
+
+	std::string file = archive + "." + suffix;
+
+	int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		error_exit(true, _("Failed opening %s"), file.c_str());
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		error_exit(true, _("Failed opening %s"), file.c_str());
+
+	// records are in time order: binary search for the first one that ends after t_from
+	uint64_t n = st.st_size / sizeof(rollup_t), lo = 0, hi = n;
+	rollup_t r;
+
+	while(lo < hi) {
+		uint64_t mid = (lo + hi) / 2;
+
+		if (pread(fd, &r, sizeof r, mid * sizeof r) != sizeof r)
+			error_exit(true, _("Problem reading %s"), file.c_str());
+
+		if (r.t + period <= t_from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	rollup_t buffer[256];
+
+	for(uint64_t i=lo; i<n;) {
+		ssize_t rc = pread(fd, buffer, sizeof buffer, i * sizeof r);
+		if (rc < ssize_t(sizeof r))
+			error_exit(true, _("Problem reading %s"), file.c_str());
+
+		for(size_t j=0; j<rc / sizeof r; j++, i++) {
+			if (buffer[j].t > t_to) {
+				close(fd);
+				return;
+			}
+
+			cb(buffer[j], arg);
+		}
+	}
+
+	close(fd);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#include "state.h"
+
+typedef struct {
+	int64_t t;	// start of the period, ms since the epoch
+	uint32_t n;	// number of samples
+	uint32_t flag_count[N_FLAGS];	// samples in which the flag was set
+	// in the int16 units of the frame: divide by measurements[].scale
+	int16_t min[N_MEASUREMENTS], max[N_MEASUREMENTS], mean[N_MEASUREMENTS], last[N_MEASUREMENTS];
+} rollup_t;
+
+// Summary of all samples in fixed periods (aligned to the epoch), one
+// fixed size record per period in <archive>.<suffix>.
+class rollup_tier
+{
+private:
+	const std::string file;
+	const int64_t period;
+	int fd;
+
+	rollup_t cur;
+	double sum[N_MEASUREMENTS];
+	bool active, resumed;
+
+	void write_cur();
+
+public:
+	rollup_tier(const std::string & archive, const char *const suffix, const int64_t period);
+	virtual ~rollup_tier();
+
+	void add(const sample_t & s);
+};
+
+typedef struct {
+	const char *suffix;
+	int64_t period;		// ms
+} rollup_tier_t;
+
+// NULL terminated, finest first
+extern const rollup_tier_t rollup_tiers[];
+
+// calls cb for each period that overlaps [t_from, t_to] (ms)
+void rollup_scan(const std::string & archive, const char *const suffix, const int64_t t_from, const int64_t t_to, void (*cb)(const rollup_t & r, void *arg), void *arg);
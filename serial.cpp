@@ -0,0 +1,260 @@
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <vector>
+
+#include "error.h"
+#include "i18n.h"
+#include "serial.h"
+#include "state.h"
+
+static const struct {
+	unsigned rate;
+	speed_t speed;
+} speeds[] = {
+	{ 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+	{ 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+	{ 230400, B230400 }, { 460800, B460800 }, { 500000, B500000 }, { 921600, B921600 },
+	{ 1000000, B1000000 }, { 2000000, B2000000 },
+	{ 0, 0 }
+};
+
+// tried by probe_baudrate(), fastest first; the odd ones are common for
+// microcontroller uarts and need termios2 on older systems
+static const unsigned probe_rates[] = { 2000000, 1000000, 921600, 500000, 460800, 250000, 230400, 115200, 57600, 38400, 19200, 9600, 0 };
+
+// frames in a row that need to be valid before a rate is accepted
+#define PROBE_FRAMES	3
+
+static speed_t to_speed(const unsigned baudrate)
+{
+	for(int i=0; speeds[i].rate; i++) {
+		if (speeds[i].rate == baudrate)
+			return speeds[i].speed;
+	}
+
+	return 0;
+}
+
+// only required when using a real serial port
+// returns false when the port can't do this (non-standard) rate
+// flush is not needed when only sending commands
+bool setser(const int fd, const unsigned baudrate, const bool flush)
+{
+	struct termios newtio, cur;
+	speed_t speed = to_speed(baudrate);
+
+	if (tcgetattr(fd, &cur) == -1)
+		error_exit(true, _("tcgetattr failed: did you select a powerbank serial port?"));
+
+	newtio = cur;
+
+	newtio.c_iflag = IGNBRK; // | ISTRIP;
+	newtio.c_oflag = 0;
+	newtio.c_cflag = (speed ? speed : B38400) | CS8 | CREAD | CLOCAL | CSTOPB;
+	newtio.c_lflag = 0;
+	newtio.c_cc[VMIN] = 1;
+	newtio.c_cc[VTIME] = 0;
+
+	// port already configured (e.g. by a previous invocation)? then leave it alone
+	bool same = speed && cur.c_iflag == newtio.c_iflag && cur.c_oflag == newtio.c_oflag && cur.c_cflag == newtio.c_cflag && cur.c_lflag == newtio.c_lflag && cur.c_cc[VMIN] == 1 && cur.c_cc[VTIME] == 0;
+
+	if (!same && tcsetattr(fd, TCSANOW, &newtio) == -1)
+		error_exit(true, _("tcsetattr failed: problem talking to serial port"));
+
+	if (!speed && !set_custom_baudrate(fd, baudrate))
+		return false;
+
+	if (flush)
+		tcflush(fd, TCIOFLUSH);
+
+	return true;
+}
+
+std::vector<uint8_t> get_bytes(const int fd, const unsigned n)
+{
+	std::vector<uint8_t> out;
+
+	struct pollfd fds[1] = { { fd, POLLIN, 0 } };
+
+	for(unsigned i=0; i<n; i++) {
+		fds[0].revents = 0;
+
+		int rc = poll(fds, 1, 100); // 100ms timeout
+		if (rc == -1)
+			error_exit(true, _("Poll on powerbank failed"));
+		if (rc == 0)
+			error_exit(true, _("Powerbank went silent"));
+
+		uint8_t c = 0;
+		rc = read(fd, &c, 1);
+		if (rc <= 0)
+			error_exit(true, _("Problem receiving state from powerbank"));
+
+		out.push_back(c);
+	}
+
+	return out;
+}
+
+void request(const int fd, const uint8_t cmd)
+{
+	if (write(fd, &cmd, 1) != 1)
+		error_exit(true, _("Problem sending command to powerbank"));
+}
+
+frame_parser parser;
+
+// throw away anything still waiting in the receive buffer, e.g. the tail of an
+// earlier reply that was cut short
+void drain(const int fd)
+{
+	// whatever was buffered and whatever is still in flight, counted as one resync
+	size_t n = parser.reset();
+
+	struct pollfd fds[1] = { { fd, POLLIN, 0 } };
+
+	for(;;) {
+		fds[0].revents = 0;
+
+		if (poll(fds, 1, 0) != 1)
+			break;
+
+		uint8_t buffer[64];
+		int rc = read(fd, buffer, sizeof buffer);
+		if (rc <= 0)
+			break;
+
+		n += rc;
+	}
+
+	parser.discarded(n);
+}
+
+// one request/reply round trip, false when the bank did not send a valid frame in time
+bool try_get_state(const int fd, std::vector<uint8_t> *state)
+{
+	drain(fd);
+
+	request(fd, CMD_GET_STATE);
+
+	struct pollfd fds[1] = { { fd, POLLIN, 0 } };
+
+	for(;;) {
+		fds[0].revents = 0;
+
+		int rc = poll(fds, 1, 100); // 100ms timeout
+		if (rc == -1)
+			error_exit(true, _("Poll on powerbank failed"));
+		if (rc == 0)
+			return false;
+
+		uint8_t buffer[STATE_FRAME_SIZE];
+		rc = read(fd, buffer, sizeof buffer);
+		if (rc <= 0)
+			error_exit(true, _("Problem receiving state from powerbank"));
+
+		parser.feed(buffer, rc);
+
+		if (parser.next(state))
+			return true;
+	}
+}
+
+std::vector<uint8_t> get_state(const int fd)
+{
+	std::vector<uint8_t> out;
+
+	while(!try_get_state(fd, &out)) {
+	}
+
+	return out;
+}
+
+// USB CDC-ACM ports ignore the line speed: the bank talks USB directly
+bool is_virtual_serial_port(const char *const dev)
+{
+	char real[PATH_MAX], link[PATH_MAX], path[PATH_MAX];
+
+	if (!realpath(dev, real))
+		return false;
+
+	snprintf(path, sizeof path, "/sys/class/tty/%s/device/driver", basename(real));
+
+	ssize_t len = readlink(path, link, sizeof link - 1);
+	if (len == -1)
+		return false;
+
+	link[len] = 0x00;
+
+	return strcmp(basename(link), "cdc_acm") == 0;
+}
+
+static bool probe_rate(const int fd, const unsigned baudrate)
+{
+	if (!setser(fd, baudrate, true))
+		return false;
+
+	std::vector<uint8_t> state;
+
+	for(int i=0; i<PROBE_FRAMES; i++) {
+		if (!try_get_state(fd, &state))
+			return false;
+	}
+
+	return true;
+}
+
+// returns the fastest rate at which the bank returns valid frames, the port is left at that rate
+unsigned probe_baudrate(const int fd, const char *const dev)
+{
+	std::vector<uint8_t> state;
+
+	if (is_virtual_serial_port(dev)) {
+		setser(fd, DEFAULT_BAUDRATE, true);
+		return DEFAULT_BAUDRATE;
+	}
+
+	setser(fd, DEFAULT_BAUDRATE, true);
+
+	if (try_get_state(fd, &state) && get_virtual_serial_port_connected(state))
+		return DEFAULT_BAUDRATE;
+
+	for(int i=0; probe_rates[i]; i++) {
+		if (probe_rate(fd, probe_rates[i]))
+			return probe_rates[i];
+	}
+
+	setser(fd, DEFAULT_BAUDRATE, true);
+
+	return DEFAULT_BAUDRATE;
+}
+
+static char to_hex(const int v)
+{
+	if (v <= 9)
+		return '0' + v;
+
+	return 'a' + v - 10;
+}
+
+void bq24295_command(const int idx, const uint8_t value, uint8_t *const cmd)
+{
+	cmd[0] = CMD_SET_BQ24295;
+	cmd[1] = '0' + idx;
+	cmd[2] = to_hex(value >> 4);
+	cmd[3] = to_hex(value & 15);
+}
+
+void print_link_stats(FILE *fh)
+{
+	const link_stats_t & ls = parser.get_stats();
+
+	fprintf(fh, _("link: %llu frames ok, %llu rejected, %llu bytes discarded, %llu resyncs, %llu relearned\n"), (unsigned long long)ls.frames_ok, (unsigned long long)ls.frames_rejected, (unsigned long long)ls.bytes_discarded, (unsigned long long)ls.resyncs, (unsigned long long)ls.soft_rejects);
+}
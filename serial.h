@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include "state.h"
+
+#define DEFAULT_BAUDRATE	9600
+
+#define CMD_GET_NAME		0x42
+#define CMD_SET_NAME		0x43
+#define CMD_GET_STATE		0x70
+#define CMD_SET_BQ24295		0x71
+#define CMD_INC_HV		0x73
+#define CMD_DEC_HV		0x74
+#define CMD_USB_ON		0x75
+#define CMD_USB_OFF		0x76
+#define CMD_HV_ON		0x77
+#define CMD_HV_OFF		0x78
+#define CMD_GET_DESCR		0xff
+
+extern frame_parser parser;
+
+bool setser(const int fd, const unsigned baudrate, const bool flush);
+bool set_custom_baudrate(const int fd, const unsigned baudrate);
+bool is_virtual_serial_port(const char *const dev);
+unsigned probe_baudrate(const int fd, const char *const dev);
+
+void drain(const int fd);
+void request(const int fd, const uint8_t cmd);
+std::vector<uint8_t> get_bytes(const int fd, const unsigned n);
+bool try_get_state(const int fd, std::vector<uint8_t> *state);
+std::vector<uint8_t> get_state(const int fd);
+// 4 bytes: writes value in register idx of the charger chip
+void bq24295_command(const int idx, const uint8_t value, uint8_t *const cmd);
+void print_link_stats(FILE *fh);
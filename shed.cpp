@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include "error.h"
+#include "i18n.h"
+#include "serial.h"
+#include "shed.h"
+#include "source.h"
+#include "state.h"
+
+load_shedder::load_shedder(state_source *const src, const char *const plan) : src(src)
+{
+	parse_plan(plan, [this](char *const item) {
+		shed_stage_t s;
+		memset(&s, 0x00, sizeof s);
+
+		if (strcasecmp(item, "usb") == 0)
+			s.action = SA_USB_OFF;
+		else if (strcasecmp(item, "hv") == 0)
+			s.action = SA_HV_OFF;
+		else if (strncasecmp(item, "hv-down:", 8) == 0 && (s.steps = atoi(item + 8)) > 0)
+			s.action = SA_HV_DOWN;
+		else
+			error_exit(false, _("%s: use usb, hv or hv-down:steps, optionally followed by @voltage"), item);
+
+		stages.push_back(s);
+	});
+
+	if (stages.empty())
+		error_exit(false, _("Shed plan is empty"));
+}
+
+load_shedder::~load_shedder()
+{
+}
+
+static void send(state_source *const src, const uint8_t cmd)
+{
+	src->command(&cmd, 1);
+}
+
+bool load_shedder::apply(const size_t nr, const std::vector<uint8_t> & state)
+{
+	shed_stage_t *const s = &stages.at(nr);
+
+	if (s->action == SA_HV_DOWN)
+		return lower_hv(s, state);
+
+	if (s->action == SA_USB_OFF) {
+		s->restore = get_usb_output_on(state);
+
+		if (s->restore) {
+			fprintf(stderr, _("On battery (%.3f V): switching USB output off\n"), get_battery_voltage(state));
+			send(src, CMD_USB_OFF);
+		}
+	}
+	else {
+		s->restore = get_hv_output_on(state);
+
+		if (s->restore) {
+			fprintf(stderr, _("On battery (%.3f V): switching HV output off\n"), get_battery_voltage(state));
+			send(src, CMD_HV_OFF);
+		}
+	}
+
+	return true;
+}
+
+bool load_shedder::lower_hv(shed_stage_t *const s, const std::vector<uint8_t> & state)
+{
+	double hv = get_hv_output_voltage(state);
+
+	if (!s->lowering) {
+		s->lowering = true;
+		s->restore = get_hv_output_on(state);
+
+		if (!s->restore)
+			return true;
+
+		fprintf(stderr, _("On battery (%.3f V): lowering HV voltage %d steps\n"), get_battery_voltage(state), s->steps);
+
+		s->hv_before = hv;
+	}
+	else if (s->pending) {
+		s->pending = false;
+
+		// already at the lowest voltage
+		if (hv >= s->hv_last)
+			return true;
+
+		s->lowered++;
+	}
+
+	if (s->lowered >= s->steps)
+		return true;
+
+	s->hv_last = hv;
+	s->pending = true;
+	send(src, CMD_DEC_HV);
+
+	return false;
+}
+
+bool load_shedder::raise_hv(shed_stage_t *const s, const std::vector<uint8_t> & state)
+{
+	double hv = get_hv_output_voltage(state);
+
+	// mains came back before the last step was checked
+	if (s->pending) {
+		s->pending = false;
+
+		if (hv < s->hv_last)
+			s->lowered++;
+	}
+
+	if (!s->raising) {
+		s->raising = true;
+		fprintf(stderr, _("Power is back: raising HV voltage to %.3f V\n"), s->hv_before);
+	}
+
+	// never more steps up than went down, whatever the frames say
+	if (s->lowered <= 0 || hv >= s->hv_before)
+		return true;
+
+	s->lowered--;
+	send(src, CMD_INC_HV);
+
+	return false;
+}
+
+// called in reverse order, so that e.g. HV is switched on before the voltage is raised again
+bool load_shedder::restore(const size_t nr, const std::vector<uint8_t> & state)
+{
+	shed_stage_t *const s = &stages.at(nr);
+
+	if (s->restore) {
+		if (s->action == SA_USB_OFF) {
+			fprintf(stderr, _("Power is back: switching USB output on\n"));
+			send(src, CMD_USB_ON);
+		}
+		else if (s->action == SA_HV_OFF) {
+			fprintf(stderr, _("Power is back: switching HV output on\n"));
+			send(src, CMD_HV_ON);
+		}
+		else if (!raise_hv(s, state)) {
+			return false;
+		}
+	}
+
+	s->restore = s->lowering = s->pending = s->raising = false;
+	s->lowered = 0;
+
+	return true;
+}
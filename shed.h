@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "source.h"
+#include "staging.h"
+#include "state.h"
+
+typedef enum { SA_USB_OFF, SA_HV_OFF, SA_HV_DOWN } shed_action_t;
+
+typedef struct {
+	shed_action_t action;
+	int steps;		// SA_HV_DOWN
+	bool restore;		// false when the output was already off: nothing to put back
+
+	// SA_HV_DOWN goes one step per sample and only counts the steps that
+	// showed up in the frames, so that restoring never raises the voltage
+	// above where it was
+	bool lowering;
+	double hv_before;	// HV output voltage before shedding
+	double hv_last;		// ...when the last step was sent
+	int lowered;		// steps that took effect
+	bool pending;		// a step was sent, its effect is not checked yet
+	bool raising;
+} shed_stage_t;
+
+// While running on battery, switches off/reduces outputs in the order of
+// the plan; puts everything back once the charging port has been powered
+// again for a little while.
+class load_shedder : public staged_plan
+{
+private:
+	state_source *const src;
+	std::vector<shed_stage_t> stages;
+
+	bool lower_hv(shed_stage_t *const s, const std::vector<uint8_t> & state);
+	bool raise_hv(shed_stage_t *const s, const std::vector<uint8_t> & state);
+
+protected:
+	bool apply(const size_t nr, const std::vector<uint8_t> & state);
+	bool restore(const size_t nr, const std::vector<uint8_t> & state);
+
+public:
+	// plan: comma separated list of usb, hv or hv-down:steps, each optionally followed by @voltage
+	load_shedder(state_source *const src, const char *const plan);
+	virtual ~load_shedder();
+};
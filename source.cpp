@@ -0,0 +1,183 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "error.h"
+#include "i18n.h"
+#include "serial.h"
+#include "source.h"
+#include "utils.h"
+
+tty_source::tty_source(const int fd, const std::atomic<bool> *const stop) : fd(fd), stop(stop)
+{
+}
+
+tty_source::~tty_source()
+{
+}
+
+bool tty_source::get(sample_t *s)
+{
+	// not get_state(): that one retries forever when the bank stays silent
+	for(;;) {
+		{
+			std::unique_lock<std::mutex> lck(lock);
+
+			if (try_get_state(fd, &s->state))
+				break;
+		}
+
+		if (stop && *stop)
+			return false;
+	}
+
+	s->mono_us = get_us(CLOCK_MONOTONIC);
+	s->wall_us = get_us(CLOCK_REALTIME);
+
+	return true;
+}
+
+void tty_source::wait(const uint64_t us)
+{
+	sleep_us(us);
+}
+
+void tty_source::command(const uint8_t *const cmd, const size_t n)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	if (write(fd, cmd, n) != ssize_t(n))
+		error_exit(true, _("Problem sending command to powerbank"));
+}
+
+replay_source::replay_source(const char *const file, const double speed) : map(NULL), size(0), pos(RECORDING_HEADER_SIZE), speed(speed), t_first(0), t_next(0), t_last(0), started(0)
+{
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		error_exit(true, _("Failed opening %s"), file);
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		error_exit(true, _("Failed opening %s"), file);
+
+	size = st.st_size;
+
+	if (size < RECORDING_HEADER_SIZE)
+		error_exit(false, _("%s is not a recording"), file);
+
+	map = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		error_exit(true, _("Failed mapping %s into memory"), file);
+
+	close(fd);
+
+	madvise((void *)map, size, MADV_SEQUENTIAL);
+
+	if (memcmp(map, RECORDING_MAGIC, RECORDING_HEADER_SIZE) != 0)
+		error_exit(false, _("%s is not a recording"), file);
+}
+
+replay_source::~replay_source()
+{
+	munmap((void *)map, size);
+}
+
+bool replay_source::get(sample_t *s)
+{
+	uint64_t t = 0;
+
+	// skip what was recorded while we were "waiting"
+	for(;;) {
+		if (pos + RECORDING_RECORD_SIZE > size)
+			return false;
+
+		memcpy(&t, &map[pos], sizeof t);
+
+		if (t >= t_next)
+			break;
+
+		pos += RECORDING_RECORD_SIZE;
+	}
+
+	const uint8_t *p = &map[pos + sizeof t];
+	s->state.assign(p, p + STATE_FRAME_SIZE);
+	pos += RECORDING_RECORD_SIZE;
+
+	if (!t_first) {
+		t_first = t;
+		started = get_us(CLOCK_MONOTONIC);
+	}
+
+	if (speed > 0) {
+		uint64_t due = started + uint64_t((t - t_first) / speed);
+		uint64_t now = get_us(CLOCK_MONOTONIC);
+
+		if (due > now)
+			sleep_us(due - now);
+	}
+
+	s->mono_us = t - t_first;
+	s->wall_us = t;
+
+	t_last = t;
+
+	return true;
+}
+
+void replay_source::wait(const uint64_t us)
+{
+	t_next = t_last + us;
+}
+
+void replay_source::command(const uint8_t *const cmd, const size_t n)
+{
+	fprintf(stderr, _("replay: not sending command"));
+
+	for(size_t i=0; i<n; i++)
+		fprintf(stderr, " %02x", cmd[i]);
+
+	fprintf(stderr, "\n");
+}
+
+recorder::recorder(const char *const file)
+{
+	fd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1)
+		error_exit(true, _("Failed opening %s"), file);
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		error_exit(true, _("Failed opening %s"), file);
+
+	if (st.st_size == 0) {
+		if (write(fd, RECORDING_MAGIC, RECORDING_HEADER_SIZE) != RECORDING_HEADER_SIZE)
+			error_exit(true, _("Problem writing to %s"), file);
+	}
+	else {
+		char magic[RECORDING_HEADER_SIZE];
+
+		if (pread(fd, magic, sizeof magic, 0) != sizeof magic || memcmp(magic, RECORDING_MAGIC, sizeof magic) != 0 || (st.st_size - RECORDING_HEADER_SIZE) % RECORDING_RECORD_SIZE)
+			error_exit(false, _("%s is not a recording"), file);
+	}
+}
+
+recorder::~recorder()
+{
+	close(fd);
+}
+
+void recorder::add(const sample_t & s)
+{
+	uint8_t record[RECORDING_RECORD_SIZE] = { 0 };
+
+	memcpy(record, &s.wall_us, sizeof s.wall_us);
+	memcpy(&record[sizeof s.wall_us], s.state.data(), STATE_FRAME_SIZE);
+
+	if (write(fd, record, sizeof record) != sizeof record)
+		error_exit(true, _("Problem writing recording"));
+}
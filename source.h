@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "state.h"
+
+// 8 bytes magic, then fixed size records: 64 bit wall clock timestamp in
+// microseconds, the state frame, padding
+#define RECORDING_MAGIC		"PBCREC1\n"
+#define RECORDING_HEADER_SIZE	8
+#define RECORDING_RECORD_SIZE	64
+
+// Where the modes get their samples from: the powerbank itself or a
+// recording. Time is the time of the source: for a replay it's the time
+// at which the sample was recorded.
+class state_source
+{
+public:
+	virtual ~state_source() { }
+
+	// false when there's nothing more to get (end of a recording, or
+	// stopped while waiting for the powerbank)
+	virtual bool get(sample_t *s) = 0;
+
+	// lets (source) time pass, e.g. between two samples
+	virtual void wait(const uint64_t us) = 0;
+
+	virtual void command(const uint8_t *const cmd, const size_t n) = 0;
+
+	virtual bool is_live() const = 0;
+};
+
+class tty_source : public state_source
+{
+private:
+	const int fd;
+
+	// get() gives up when this gets set while the bank stays silent
+	const std::atomic<bool> *const stop;
+
+	// commands may come from other threads than the one reading the state
+	std::mutex lock;
+
+public:
+	tty_source(const int fd, const std::atomic<bool> *const stop = NULL);
+	virtual ~tty_source();
+
+	bool get(sample_t *s);
+	void wait(const uint64_t us);
+	void command(const uint8_t *const cmd, const size_t n);
+	bool is_live() const { return true; }
+};
+
+// Reads a recording (see -m record) from a memory mapped file. speed is
+// relative to realtime, 0 replays as fast as possible.
+class replay_source : public state_source
+{
+private:
+	const uint8_t *map;
+	size_t size, pos;
+	const double speed;
+
+	uint64_t t_first, t_next, t_last;
+	uint64_t started;	// CLOCK_MONOTONIC when the first sample was returned
+
+public:
+	replay_source(const char *const file, const double speed);
+	virtual ~replay_source();
+
+	bool get(sample_t *s);
+	void wait(const uint64_t us);
+	void command(const uint8_t *const cmd, const size_t n);
+	bool is_live() const { return false; }
+};
+
+class recorder
+{
+private:
+	int fd;
+
+public:
+	recorder(const char *const file);
+	virtual ~recorder();
+
+	void add(const sample_t & s);
+};
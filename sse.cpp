@@ -0,0 +1,479 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "error.h"
+#include "i18n.h"
+#include "sse.h"
+#include "state.h"
+#include "utils.h"
+
+// maximum size of the request header of a client
+#define MAX_REQUEST	4096
+// buffers given to one sendmsg() call
+#define MAX_IOV		SSE_MAX_QUEUE
+
+static const sse_buffer_t http_not_found = std::make_shared<const std::string>(
+	"HTTP/1.1 404 Not Found\r\n"
+	"Content-Type: text/plain\r\n"
+	"Connection: close\r\n"
+	"\r\n"
+	"use /events\n");
+
+sse_server::sse_server(const char *const listen, const char *const allow_origin) : listen_fd(-1), stop(false)
+{
+	std::string ok =
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/event-stream\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Connection: keep-alive\r\n";
+
+	// cross-origin access (e.g. an EventSource on a page served elsewhere) only when asked for
+	if (allow_origin) {
+		if (strpbrk(allow_origin, "\r\n"))
+			error_exit(false, _("%s: invalid origin"), allow_origin);
+
+		ok += std::string("Access-Control-Allow-Origin: ") + allow_origin + "\r\n";
+	}
+
+	http_ok = std::make_shared<const std::string>(ok + "\r\n");
+
+	std::string spec = listen;
+
+	if (spec.find('/') != std::string::npos)
+		listen_unix(spec);
+	else {
+		size_t colon = spec.rfind(':');
+
+		if (colon == std::string::npos)
+			listen_tcp("localhost", spec);
+		else {
+			std::string host = spec.substr(0, colon);
+
+			// [::1]:8080
+			if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+				host = host.substr(1, host.size() - 2);
+
+			listen_tcp(host, spec.substr(colon + 1));
+		}
+	}
+
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd == -1)
+		error_exit(true, _("eventfd failed"));
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1)
+		error_exit(true, _("epoll_create1 failed"));
+
+	struct epoll_event ev { };
+	ev.events = EPOLLIN;
+
+	ev.data.ptr = &listen_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+	ev.data.ptr = &wake_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+	th = start_thread([this]() { handler(); });
+}
+
+sse_server::~sse_server()
+{
+	stop = true;
+
+	uint64_t one = 1;
+	if (write(wake_fd, &one, sizeof one) != sizeof one)
+		fprintf(stderr, _("Problem waking up the event stream server\n"));
+
+	th->join();
+	delete th;
+
+	for(auto & c : clients) {
+		close(c->fd);
+		delete c;
+	}
+
+	close(epoll_fd);
+	close(wake_fd);
+	close(listen_fd);
+
+	if (!unix_path.empty())
+		unlink(unix_path.c_str());
+}
+
+// numeric addresses only: getaddrinfo() would pull NSS into the static build
+void sse_server::listen_tcp(const std::string & host, const std::string & port)
+{
+	char *end = NULL;
+	long nr = strtol(port.c_str(), &end, 10);
+	if (port.empty() || *end || nr < 1 || nr > 65535)
+		error_exit(false, _("%s: invalid port"), port.c_str());
+
+	struct sockaddr_storage addr { };
+	socklen_t addr_len = 0;
+
+	struct sockaddr_in *in4 = (struct sockaddr_in *)&addr;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+
+	if (inet_pton(AF_INET, host == "localhost" ? "127.0.0.1" : host.c_str(), &in4->sin_addr) == 1) {
+		in4->sin_family = AF_INET;
+		in4->sin_port = htons(nr);
+		addr_len = sizeof *in4;
+	}
+	else if (inet_pton(AF_INET6, host.c_str(), &in6->sin6_addr) == 1) {
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(nr);
+		addr_len = sizeof *in6;
+	}
+	else {
+		error_exit(false, _("%s: not a numeric address"), host.c_str());
+	}
+
+	listen_fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd == -1)
+		error_exit(true, _("Cannot create socket"));
+
+	int on = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+
+	if (bind(listen_fd, (struct sockaddr *)&addr, addr_len) == -1 || ::listen(listen_fd, SOMAXCONN) == -1)
+		error_exit(true, _("Cannot listen on %s:%s"), host.c_str(), port.c_str());
+}
+
+void sse_server::listen_unix(const std::string & path)
+{
+	struct sockaddr_un addr { };
+	addr.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof addr.sun_path)
+		error_exit(false, _("%s: path too long"), path.c_str());
+
+	memcpy(addr.sun_path, path.c_str(), path.size());
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd == -1)
+		error_exit(true, _("Cannot create socket"));
+
+	// left behind by a previous run; anything else at that path is not ours to remove
+	struct stat st;
+	if (lstat(path.c_str(), &st) == 0) {
+		if (!S_ISSOCK(st.st_mode))
+			error_exit(false, _("%s exists and is not a socket"), path.c_str());
+
+		unlink(path.c_str());
+	}
+
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) == -1 || ::listen(listen_fd, SOMAXCONN) == -1)
+		error_exit(true, _("Cannot listen on %s"), path.c_str());
+
+	unix_path = path;
+}
+
+void sse_server::accept_client()
+{
+	for(;;) {
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1)
+			break;
+
+		if (clients.size() >= SSE_MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+
+		sse_client_t *c = new sse_client_t { fd, "", false, { }, 0, 0 };
+
+		struct epoll_event ev { };
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			close(fd);
+			delete c;
+			continue;
+		}
+
+		clients.push_back(c);
+	}
+}
+
+void sse_server::close_client(sse_client_t *const c)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+
+	for(auto it = clients.begin(); it != clients.end(); it++) {
+		if (*it == c) {
+			clients.erase(it);
+			break;
+		}
+	}
+
+	// there may be more events for it in the current batch
+	c->fd = -1;
+	closed.push_back(c);
+}
+
+// returns false when the client should be disconnected
+bool sse_server::read_request(sse_client_t *const c)
+{
+	char buffer[1024];
+
+	for(;;) {
+		ssize_t rc = read(c->fd, buffer, sizeof buffer);
+
+		if (rc == 0)
+			return false;
+
+		if (rc == -1)
+			return errno == EAGAIN || errno == EINTR;
+
+		// anything after the request header is ignored
+		if (c->streaming)
+			continue;
+
+		c->request.append(buffer, rc);
+
+		if (c->request.find("\r\n\r\n") == std::string::npos) {
+			if (c->request.size() > MAX_REQUEST)
+				return false;
+
+			continue;
+		}
+
+		c->streaming = true;
+
+		if (c->request.compare(0, 12, "GET /events ") == 0 || c->request.compare(0, 6, "GET / ") == 0)
+			c->queue.push_back(http_ok);
+		else {
+			c->queue.push_back(http_not_found);
+			send_queue(c);
+
+			return false;
+		}
+
+		c->request.clear();
+		c->request.shrink_to_fit();
+
+		return send_queue(c);
+	}
+}
+
+// vectored write of as much of the queue as the socket takes
+bool sse_server::send_queue(sse_client_t *const c)
+{
+	while(!c->queue.empty()) {
+		struct iovec iov[MAX_IOV];
+		int n = 0;
+
+		for(auto it = c->queue.begin(); it != c->queue.end() && n < MAX_IOV; it++, n++) {
+			size_t skip = n == 0 ? c->offset : 0;
+
+			iov[n].iov_base = (void *)((*it)->data() + skip);
+			iov[n].iov_len = (*it)->size() - skip;
+		}
+
+		struct msghdr msg { };
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+
+		ssize_t rc = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN)
+				return false;
+
+			break;
+		}
+
+		size_t sent = rc;
+
+		while(sent && !c->queue.empty()) {
+			size_t left = c->queue.front()->size() - c->offset;
+
+			if (sent < left) {
+				c->offset += sent;
+				break;
+			}
+
+			sent -= left;
+			c->offset = 0;
+			c->queue.pop_front();
+		}
+
+		c->dropped = 0;
+	}
+
+	// only ask for EPOLLOUT while something is waiting
+	struct epoll_event ev { };
+	ev.events = EPOLLIN | (c->queue.empty() ? 0u : unsigned(EPOLLOUT));
+	ev.data.ptr = c;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+
+	return true;
+}
+
+// returns false when the client fell too far behind
+bool sse_server::enqueue(sse_client_t *const c, const sse_buffer_t & b)
+{
+	// drop the oldest complete frame; a partially sent one must be finished
+	// and the response header is never dropped
+	if (c->queue.size() >= SSE_MAX_QUEUE) {
+		if (++c->dropped > SSE_MAX_DROPPED)
+			return false;
+
+		c->queue.erase(c->queue.begin() + (c->offset || c->queue.front() == http_ok ? 1 : 0));
+	}
+
+	c->queue.push_back(b);
+
+	return true;
+}
+
+void sse_server::handler()
+{
+	struct epoll_event events[64];
+
+	while(!stop) {
+		int n = epoll_wait(epoll_fd, events, 64, -1);
+
+		for(int i=0; i<n; i++) {
+			void *const p = events[i].data.ptr;
+
+			if (p == &listen_fd)
+				accept_client();
+			else if (p == &wake_fd) {
+				uint64_t dummy = 0;
+				if (read(wake_fd, &dummy, sizeof dummy) == -1 && errno != EAGAIN)
+					error_exit(true, _("Problem reading eventfd"));
+
+				std::vector<sse_buffer_t> work;
+				{
+					std::lock_guard<std::mutex> lck(lock);
+					work.swap(pending);
+				}
+
+				// copy: a client that fails is removed from the list
+				std::vector<sse_client_t *> current = clients;
+
+				for(auto & c : current) {
+					if (!c->streaming)
+						continue;
+
+					bool was_empty = c->queue.empty(), ok = true;
+
+					for(auto & b : work)
+						ok = ok && enqueue(c, b);
+
+					// when something is still queued, EPOLLOUT is already pending
+					if (!ok || (was_empty && !send_queue(c)))
+						close_client(c);
+				}
+			}
+			else {
+				sse_client_t *c = (sse_client_t *)p;
+
+				if (c->fd == -1)
+					continue;
+
+				// with EPOLLIN also set, read() below sees the hangup
+				bool ok = (events[i].events & (EPOLLERR | EPOLLHUP)) == 0;
+
+				if (ok && (events[i].events & EPOLLIN))
+					ok = read_request(c);
+
+				if (ok && (events[i].events & EPOLLOUT))
+					ok = send_queue(c);
+
+				if (!ok)
+					close_client(c);
+			}
+		}
+
+		for(auto & c : closed)
+			delete c;
+
+		closed.clear();
+	}
+}
+
+// printf to the end of a string, without a limit on the length
+static void append_format(std::string *const out, const char *const format, ...)
+{
+	char buffer[256];
+
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(buffer, sizeof buffer, format, ap);
+	va_end(ap);
+
+	if (len < 0)
+		return;
+
+	if (size_t(len) < sizeof buffer) {
+		out->append(buffer, len);
+		return;
+	}
+
+	size_t offset = out->size();
+	out->resize(offset + len + 1);
+
+	va_start(ap, format);
+	vsnprintf(&(*out)[offset], len + 1, format, ap);
+	va_end(ap);
+
+	out->resize(offset + len);
+}
+
+void sse_server::publish(const sample_t & s)
+{
+	const std::vector<uint8_t> & state = s.state;
+
+	std::string out;
+	out.reserve(1024);
+
+	append_format(&out, "id: %llu\nevent: sample\ndata: { \"wall-ms\" : %llu, \"mono-ms\" : %llu",
+			(unsigned long long)(s.wall_us / 1000), (unsigned long long)(s.wall_us / 1000), (unsigned long long)(s.mono_us / 1000));
+
+	for(int i=0; measurements[i].name; i++)
+		append_format(&out, ", \"%s\" : %f", measurements[i].name, measurements[i].get(state));
+
+	for(int i=0; flags[i].name; i++)
+		append_format(&out, ", \"%s\" : %s", flags[i].name, state.at(flags[i].offset) & flags[i].mask ? "true" : "false");
+
+	append_format(&out, ", \"battery-uptime\" : %u }\n\n", get_battery_uptime(state));
+
+	sse_buffer_t b = std::make_shared<const std::string>(std::move(out));
+
+	{
+		std::lock_guard<std::mutex> lck(lock);
+
+		// the server thread is stalled: don't let this grow without bounds
+		if (pending.size() >= SSE_MAX_PENDING)
+			pending.erase(pending.begin());
+
+		pending.push_back(b);
+	}
+
+	uint64_t one = 1;
+	if (write(wake_fd, &one, sizeof one) != sizeof one && errno != EAGAIN)
+		fprintf(stderr, _("Problem waking up the event stream server\n"));
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "state.h"
+
+// frames queued for a client before it starts losing them
+#define SSE_MAX_QUEUE	32
+// frames a client may lose in a row before it is disconnected
+#define SSE_MAX_DROPPED	(SSE_MAX_QUEUE * 4)
+// frames published while the server thread didn't get to them yet
+#define SSE_MAX_PENDING	SSE_MAX_QUEUE
+#define SSE_MAX_CLIENTS	1024
+
+typedef std::shared_ptr<const std::string> sse_buffer_t;
+
+typedef struct {
+	int fd;
+	std::string request;	// until the header has been received
+	bool streaming;
+	std::deque<sse_buffer_t> queue;
+	size_t offset;		// of what was already sent from queue.front()
+	uint64_t dropped;	// in a row, reset when something gets sent
+} sse_client_t;
+
+// Streams samples as Server-Sent Events to any number of HTTP clients
+// (e.g. curl -N http://localhost:8080/events or an EventSource in a
+// browser). Every sample is encoded once; all clients share that buffer.
+// A client that doesn't keep up loses frames instead of slowing down
+// the others or the acquisition, and is disconnected when it falls too
+// far behind.
+class sse_server
+{
+private:
+	std::string unix_path;
+	int listen_fd, wake_fd, epoll_fd;
+	sse_buffer_t http_ok;
+
+	std::mutex lock;
+	std::vector<sse_buffer_t> pending;
+
+	std::vector<sse_client_t *> clients, closed;
+
+	std::atomic<bool> stop;
+	std::thread *th;
+
+	void listen_tcp(const std::string & host, const std::string & port);
+	void listen_unix(const std::string & path);
+
+	void accept_client();
+	void close_client(sse_client_t *const c);
+	bool read_request(sse_client_t *const c);
+	bool send_queue(sse_client_t *const c);
+	bool enqueue(sse_client_t *const c, const sse_buffer_t & b);
+	void handler();
+
+public:
+	// listen: [host:]port (host defaults to localhost) or a path for a unix domain socket
+	// allow_origin: value of the Access-Control-Allow-Origin header, NULL for none
+	sse_server(const char *const listen, const char *const allow_origin);
+	virtual ~sse_server();
+
+	void publish(const sample_t & s);
+};
@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "staging.h"
+#include "state.h"
+
+// mains must be back for this long before anything is restored
+#define RESTORE_DELAY	5000000 // us
+
+staged_plan::staged_plan() : on_battery(false), mains_since(0)
+{
+}
+
+staged_plan::~staged_plan()
+{
+}
+
+void staged_plan::parse_plan(const char *const plan, std::function<void(char *const item)> parse)
+{
+	char *copy = strdup(plan), *saveptr = NULL;
+
+	for(char *item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+		stage_progress_t p { 0., false, false };
+
+		char *at = strchr(item, '@');
+		if (at) {
+			*at = 0x00;
+			p.voltage = atof(at + 1);
+		}
+
+		parse(item);
+
+		progress.push_back(p);
+	}
+
+	free(copy);
+}
+
+// in reverse order; a stage that isn't done yet holds up the ones before it
+void staged_plan::restore_stages(const std::vector<uint8_t> & state)
+{
+	for(size_t nr = progress.size(); nr-- > 0;) {
+		stage_progress_t & p = progress.at(nr);
+
+		if (!p.applied)
+			continue;
+
+		if (!restore(nr, state))
+			return;
+
+		p.applied = p.done = false;
+	}
+}
+
+void staged_plan::process(const sample_t & s)
+{
+	if (get_charging_port_plugged_in(s.state)) {
+		if (on_battery) {
+			on_battery = false;
+			mains_since = s.mono_us;
+		}
+
+		if (s.mono_us - mains_since >= RESTORE_DELAY)
+			restore_stages(s.state);
+
+		return;
+	}
+
+	on_battery = true;
+
+	double voltage = get_battery_voltage(s.state);
+
+	// stages are applied in order: a later stage never goes before an earlier one
+	for(size_t nr = 0; nr < progress.size(); nr++) {
+		stage_progress_t & p = progress.at(nr);
+
+		if (p.done)
+			continue;
+
+		if (!p.applied && p.voltage > 0 && voltage > p.voltage)
+			break;
+
+		p.applied = true;
+
+		if (!apply(nr, s.state))
+			break;
+
+		p.done = true;
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <functional>
+#include <stdint.h>
+#include <vector>
+
+#include "state.h"
+
+typedef struct {
+	double voltage;		// battery voltage at or below which to apply, 0 for as soon as mains drops
+	bool applied;		// apply() was called
+	bool done;		// apply() returned true: nothing more to do while on battery
+} stage_progress_t;
+
+// What the load shedder and the host saver have in common: while running on
+// battery the stages of a plan are applied in order, each one optionally
+// waiting for the battery voltage to drop. Once the charging port has been
+// powered again for a little while, they are restored in reverse order.
+// The subclass does the actual work in apply() and restore(); both may take
+// more than one sample by returning false.
+class staged_plan
+{
+private:
+	std::vector<stage_progress_t> progress;
+
+	bool on_battery;
+	uint64_t mains_since;
+
+protected:
+	// splits a comma separated plan, parse() gets each item without its @voltage
+	void parse_plan(const char *const plan, std::function<void(char *const item)> parse);
+
+	// return true when the stage is done
+	virtual bool apply(const size_t nr, const std::vector<uint8_t> & state) = 0;
+	virtual bool restore(const size_t nr, const std::vector<uint8_t> & state) = 0;
+
+	// state is passed on to restore()
+	void restore_stages(const std::vector<uint8_t> & state);
+
+public:
+	staged_plan();
+	virtual ~staged_plan();
+
+	void process(const sample_t & s);
+};
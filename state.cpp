@@ -0,0 +1,335 @@
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "state.h"
+
+// celsius
+double get_temp(const std::vector<uint8_t> & state)
+{
+	int16_t v = state.at(0) | (state.at(1) << 8);
+
+	return v / 100.0;
+}
+
+double get_milli(const std::vector<uint8_t> & state, const int offset)
+{
+	int16_t v = state.at(offset + 0) | (state.at(offset + 1) << 8);
+
+	return v / 1000.0;
+}
+
+// mV
+double get_battery_voltage(const std::vector<uint8_t> & state)
+{
+	return get_milli(state, 2);
+}
+
+// mA
+double get_charging_current(const std::vector<uint8_t> & state)
+{
+	return get_milli(state, 4);
+}
+
+// mA
+double get_hv_output_current(const std::vector<uint8_t> & state)
+{
+	return get_milli(state, 6);
+}
+
+// mA
+double get_usb_output_current(const std::vector<uint8_t> & state)
+{
+	return get_milli(state, 8);
+}
+
+// mV
+double get_hv_output_voltage(const std::vector<uint8_t> & state)
+{
+	return get_milli(state, 0x0a);
+}
+
+std::vector<uint8_t> get_i2c_BQ24295(const std::vector<uint8_t> & state)
+{
+	std::vector<uint8_t> out;
+
+	for(int i=0x18; i<=0x21; i++)
+		out.push_back(state.at(i));
+
+	return out;
+}
+
+uint8_t get_flags_0x22(const std::vector<uint8_t> & state)
+{
+	return state.at(0x22);
+}
+
+bool get_auto_send_statemachine(const std::vector<uint8_t> & state)
+{
+	return get_flags_0x22(state) & 128;
+}
+
+bool get_virtual_serial_port_connected(const std::vector<uint8_t> & state)
+{
+	return get_flags_0x22(state) & 64;
+}
+
+bool get_charging_port_plugged_in(const std::vector<uint8_t> & state)
+{
+	return get_flags_0x22(state) & 32;
+}
+
+bool get_warnings_enabled(const std::vector<uint8_t> & state)
+{
+	return get_flags_0x22(state) & 16;
+}
+
+bool get_charger_fault(const std::vector<uint8_t> & state)
+{
+	return get_flags_0x22(state) & 8;
+}
+
+bool get_battery_overvoltage(const std::vector<uint8_t> & state)
+{
+	return get_flags_0x22(state) & 4;
+}
+
+bool get_battery_too_cold(const std::vector<uint8_t> & state)
+{
+	return get_flags_0x22(state) & 2;
+}
+
+bool get_battery_too_hot(const std::vector<uint8_t> & state)
+{
+	return get_flags_0x22(state) & 1;
+}
+
+uint8_t get_flags_0x23(const std::vector<uint8_t> & state)
+{
+	return state.at(0x23);
+}
+
+//
+bool get_hv_output_on(const std::vector<uint8_t> & state)
+{
+	return get_flags_0x23(state) & 128;
+}
+
+bool get_usb_output_on(const std::vector<uint8_t> & state)
+{
+	return get_flags_0x23(state) & 64;
+}
+
+uint32_t get_battery_uptime(const std::vector<uint8_t> & state)
+{
+	return (state.at(0x27) << 24) | (state.at(0x26) << 16) | (state.at(0x25) << 8) | state.at(0x24);
+}
+
+const measurement_t measurements[] = {
+	{ "temperature", get_temp, 0x00, 100. },
+	{ "battery-voltage", get_battery_voltage, 0x02, 1000. },
+	{ "charging-current", get_charging_current, 0x04, 1000. },
+	{ "HV-output-current", get_hv_output_current, 0x06, 1000. },
+	{ "HV-output-voltage", get_hv_output_voltage, 0x0a, 1000. },
+	{ "USB-output-current", get_usb_output_current, 0x08, 1000. },
+	{ NULL, NULL, 0, 0. }
+};
+
+int16_t get_raw(const measurement_t & m, const std::vector<uint8_t> & state)
+{
+	return state.at(m.offset) | (state.at(m.offset + 1) << 8);
+}
+
+const flag_t flags[] = {
+	{ 0x22, 128, "auto-send-statemachine" },
+	{ 0x22, 64, "virtual-serial-port-connected" },
+	{ 0x22, 32, "charging-port-plugged-in" },
+	{ 0x22, 16, "warnings-enabled" },
+	{ 0x22, 8, "charger-fault" },
+	{ 0x22, 4, "battery-overvoltage" },
+	{ 0x22, 2, "battery-too-cold" },
+	{ 0x22, 1, "battery-too-hot" },
+	{ 0x23, 128, "hv-output" },
+	{ 0x23, 64, "usb-output" },
+	{ 0, 0, NULL }
+};
+
+// plausibility limits, way beyond what the hardware can do
+#define MIN_TEMP		-40.0
+#define MAX_TEMP		125.0
+#define MAX_BATTERY_VOLTAGE	6.0
+#define MAX_CURRENT		5.0
+#define MAX_HV_VOLTAGE		30.0
+
+// after this many frames the constant bytes are considered reserved
+#define LEARN_FRAMES		8
+// below this uptime (seconds) a jump back is treated as a reboot of the bank
+#define REBOOT_UPTIME		60
+
+static bool decoded_byte(const int offset)
+{
+	return offset <= 0x0b || (offset >= 0x18 && offset <= 0x27);
+}
+
+const char *check_state(const std::vector<uint8_t> & state)
+{
+	if (state.size() != STATE_FRAME_SIZE)
+		return "invalid frame size";
+
+	double temp = get_temp(state);
+	if (temp < MIN_TEMP || temp > MAX_TEMP)
+		return "temperature out of range";
+
+	double bv = get_battery_voltage(state);
+	if (bv < 0.0 || bv > MAX_BATTERY_VOLTAGE)
+		return "battery voltage out of range";
+
+	if (fabs(get_charging_current(state)) > MAX_CURRENT || fabs(get_hv_output_current(state)) > MAX_CURRENT || fabs(get_usb_output_current(state)) > MAX_CURRENT)
+		return "current out of range";
+
+	double hv = get_hv_output_voltage(state);
+	if (hv < -0.5 || hv > MAX_HV_VOLTAGE)
+		return "HV voltage out of range";
+
+	return NULL;
+}
+
+frame_parser::frame_parser()
+{
+	stats.frames_ok = stats.frames_rejected = 0;
+	stats.bytes_discarded = stats.resyncs = 0;
+	stats.soft_rejects = 0;
+
+	reset();
+	learn_frames = 0;
+	have_uptime = false;
+	prev_uptime = 0;
+	memset(reserved, 0x00, sizeof reserved);
+	memset(reserved_mask, 0x00, sizeof reserved_mask);
+}
+
+void frame_parser::feed(const uint8_t *data, const size_t n)
+{
+	buffer.insert(buffer.end(), data, data + n);
+}
+
+size_t frame_parser::reset()
+{
+	size_t n = buffer.size();
+
+	buffer.clear();
+
+	return n;
+}
+
+void frame_parser::discarded(const size_t n)
+{
+	if (n) {
+		stats.bytes_discarded += n;
+		stats.resyncs++;
+	}
+}
+
+const char *frame_parser::check_reserved(const std::vector<uint8_t> & state)
+{
+	if (learn_frames >= LEARN_FRAMES) {
+		for(int i=0; i<STATE_FRAME_SIZE; i++) {
+			if (reserved_mask[i] && state.at(i) != reserved[i])
+				return "reserved byte changed";
+		}
+	}
+
+	uint32_t uptime = get_battery_uptime(state);
+	if (have_uptime && uptime < prev_uptime && uptime >= REBOOT_UPTIME)
+		return "battery uptime went backwards";
+
+	return NULL;
+}
+
+void frame_parser::learn(const std::vector<uint8_t> & state)
+{
+	if (learn_frames == 0) {
+		for(int i=0; i<STATE_FRAME_SIZE; i++) {
+			reserved[i] = state.at(i);
+			reserved_mask[i] = !decoded_byte(i);
+		}
+	}
+	else if (learn_frames < LEARN_FRAMES) {
+		for(int i=0; i<STATE_FRAME_SIZE; i++) {
+			if (state.at(i) != reserved[i])
+				reserved_mask[i] = false;
+		}
+	}
+
+	if (learn_frames < LEARN_FRAMES)
+		learn_frames++;
+
+	prev_uptime = get_battery_uptime(state);
+	have_uptime = true;
+}
+
+// is there a frame further on in the buffer that passes all checks?
+bool frame_parser::aligned_later()
+{
+	std::vector<uint8_t> candidate(STATE_FRAME_SIZE);
+
+	for(size_t offset=1; offset + STATE_FRAME_SIZE <= buffer.size(); offset++) {
+		std::copy(buffer.begin() + offset, buffer.begin() + offset + STATE_FRAME_SIZE, candidate.begin());
+
+		if (check_state(candidate) == NULL && check_reserved(candidate) == NULL)
+			return true;
+	}
+
+	return false;
+}
+
+bool frame_parser::next(std::vector<uint8_t> *state)
+{
+	bool dropping = false;
+
+	while(buffer.size() >= STATE_FRAME_SIZE) {
+		std::vector<uint8_t> candidate(buffer.begin(), buffer.begin() + STATE_FRAME_SIZE);
+
+		bool ok = check_state(candidate) == NULL;
+
+		if (ok && check_reserved(candidate)) {
+			if (!dropping && !aligned_later()) {
+				// lined up with the start of the reply: the bank changed (e.g. rebooted), not the stream
+				stats.soft_rejects++;
+
+				learn_frames = 0;
+				have_uptime = false;
+			}
+			else {
+				ok = false;
+			}
+		}
+
+		if (ok) {
+			learn(candidate);
+
+			buffer.erase(buffer.begin(), buffer.begin() + STATE_FRAME_SIZE);
+
+			stats.frames_ok++;
+
+			*state = candidate;
+
+			return true;
+		}
+
+		// out of sync: slide one byte and try again
+		if (!dropping) {
+			stats.frames_rejected++;
+			stats.resyncs++;
+			dropping = true;
+		}
+
+		stats.bytes_discarded++;
+
+		buffer.erase(buffer.begin());
+	}
+
+	return false;
+}
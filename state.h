@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+#define STATE_FRAME_SIZE	51
+
+double get_temp(const std::vector<uint8_t> & state);
+double get_milli(const std::vector<uint8_t> & state, const int offset);
+double get_battery_voltage(const std::vector<uint8_t> & state);
+double get_charging_current(const std::vector<uint8_t> & state);
+double get_hv_output_current(const std::vector<uint8_t> & state);
+double get_usb_output_current(const std::vector<uint8_t> & state);
+double get_hv_output_voltage(const std::vector<uint8_t> & state);
+std::vector<uint8_t> get_i2c_BQ24295(const std::vector<uint8_t> & state);
+uint8_t get_flags_0x22(const std::vector<uint8_t> & state);
+bool get_auto_send_statemachine(const std::vector<uint8_t> & state);
+bool get_virtual_serial_port_connected(const std::vector<uint8_t> & state);
+bool get_charging_port_plugged_in(const std::vector<uint8_t> & state);
+bool get_warnings_enabled(const std::vector<uint8_t> & state);
+bool get_charger_fault(const std::vector<uint8_t> & state);
+bool get_battery_overvoltage(const std::vector<uint8_t> & state);
+bool get_battery_too_cold(const std::vector<uint8_t> & state);
+bool get_battery_too_hot(const std::vector<uint8_t> & state);
+uint8_t get_flags_0x23(const std::vector<uint8_t> & state);
+bool get_hv_output_on(const std::vector<uint8_t> & state);
+bool get_usb_output_on(const std::vector<uint8_t> & state);
+uint32_t get_battery_uptime(const std::vector<uint8_t> & state);
+
+typedef struct {
+	uint64_t mono_us, wall_us;	// when it was received
+	std::vector<uint8_t> state;
+} sample_t;
+
+typedef struct {
+	const char *name;
+	double (*get)(const std::vector<uint8_t> & state);
+	int offset;		// of the int16 in the frame: get() is that divided by scale
+	double scale;
+} measurement_t;
+
+// the int16 a measurement is decoded from
+int16_t get_raw(const measurement_t & m, const std::vector<uint8_t> & state);
+
+// everything decoded by get_temp() and get_milli(), NULL terminated
+extern const measurement_t measurements[];
+#define N_MEASUREMENTS	6
+
+typedef struct {
+	int offset;
+	uint8_t mask;
+	const char *name;
+} flag_t;
+
+// the named bits in 0x22/0x23, NULL terminated
+extern const flag_t flags[];
+#define N_FLAGS		10
+
+// returns NULL when the frame looks sane, else a (short) reason
+const char *check_state(const std::vector<uint8_t> & state);
+
+// updated by the acquisition thread, read by the others
+typedef struct {
+	std::atomic<uint64_t> frames_ok, frames_rejected;
+	std::atomic<uint64_t> bytes_discarded, resyncs;
+	std::atomic<uint64_t> soft_rejects;	// aligned frames that only failed the reserved/uptime checks: accepted and learned again
+} link_stats_t;
+
+// Reassembles state frames from a byte stream that may contain garbage
+// (left-overs of earlier replies, line noise). Candidates that fail
+// check_state() are dropped one byte at a time until the stream lines up
+// again. One that only doesn't match the learned reserved bytes is only
+// dropped when a later offset in the buffer does match; else the bank
+// changed and the reserved bytes are learned again.
+class frame_parser
+{
+private:
+	std::vector<uint8_t> buffer;
+
+	// bytes not decoded by any accessor are expected to stay constant
+	uint8_t reserved[STATE_FRAME_SIZE];
+	bool reserved_mask[STATE_FRAME_SIZE];
+	int learn_frames;
+
+	bool have_uptime;
+	uint32_t prev_uptime;
+
+	link_stats_t stats;
+
+	const char *check_reserved(const std::vector<uint8_t> & state);
+	void learn(const std::vector<uint8_t> & state);
+	bool aligned_later();
+
+public:
+	frame_parser();
+
+	void feed(const uint8_t *data, const size_t n);
+	bool next(std::vector<uint8_t> *state);
+
+	// throw away what is buffered, e.g. after a timeout. returns the number
+	// of bytes thrown away; counting them is up to the caller (discarded())
+	size_t reset();
+	// n bytes were thrown away: one resync
+	void discarded(const size_t n);
+
+	size_t pending() const { return buffer.size(); }
+	const link_stats_t & get_stats() const { return stats; }
+};
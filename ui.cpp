@@ -0,0 +1,433 @@
+#include <algorithm>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/ioctl.h>
+
+#include "i18n.h"
+#include "serial.h"
+#include "state.h"
+#include "ui.h"
+
+bool ansi_terminal(void)
+{
+	const char *term = getenv("TERM");
+
+	if (!isatty(1) || !isatty(2))
+		return false;
+
+	if (!term)
+		return false;
+
+	if (strcasestr(term, "ansi") == 0)
+		return true;
+
+	if (strcasestr(term, "console") == 0 || strcasestr(term, "con80x25") == 0 || strcasestr(term, "linux") == 0)
+		return true;
+
+	if (strcasestr(term, "screen") == 0)
+		return true;
+
+	if (strcasestr(term, "xterm") == 0)
+		return true;
+
+	if (strcasestr(term, "rxvt") == 0 || strcasestr(term, "konsole") == 0)
+		return true;
+
+	return false;
+}
+
+void set_bold(bool on)
+{
+	if (ansi_terminal()) {
+		if (on)
+			fprintf(stderr, "\x1b[1m");
+		else
+			fprintf(stderr, "\x1b[22m");
+	}
+}
+
+void set_underline(bool on)
+{
+	if (ansi_terminal()) {
+		if (on)
+			fprintf(stderr, "\x1b[4m");
+		else
+			fprintf(stderr, "\x1b[24m");
+	}
+}
+
+void reset_term()
+{
+	if (ansi_terminal())
+		fprintf(stderr, "\x1b[0m\x1b[2K\r");
+}
+
+void help_header(const char *str)
+{
+	fprintf(stderr, "\n");
+
+	set_bold(1);
+	fprintf(stderr, " *** ");
+
+	set_underline(1);
+	fprintf(stderr, "%s", str);
+	set_underline(0);
+
+	fprintf(stderr, " ***\n");
+	set_bold(0);
+}
+
+#define SWITCHES_COLUMN_WIDTH	24
+
+int max_x = 80, max_y = 24;
+
+void determine_terminal_size(void)
+{
+	struct winsize size;
+
+	max_x = max_y = 0;
+
+	if (!isatty(1))
+	{
+		max_y = 24;
+		max_x = 80;
+	}
+#ifdef TIOCGWINSZ
+	else if (ioctl(1, TIOCGWINSZ, &size) == 0)
+	{
+		max_y = size.ws_row;
+		max_x = size.ws_col;
+	}
+#endif
+
+	if (!max_x || !max_y)
+	{
+		char *dummy = getenv("COLUMNS");
+		if (dummy)
+			max_x = atoi(dummy);
+		else
+			max_x = 80;
+
+		dummy = getenv("LINES");
+		if (dummy)
+			max_y = atoi(dummy);
+		else
+			max_y = 24;
+	}
+}
+
+void str_add(char **to, const char *what, ...)
+{
+	int len_to = *to ? strlen(*to) : 0;
+	char *buffer = NULL;
+	int len_what = 0;
+
+	va_list ap;
+
+	va_start(ap, what);
+	len_what = vasprintf(&buffer, what, ap);
+	va_end(ap);
+
+	*to = (char *)realloc(*to, len_to + len_what + 1);
+
+	memcpy(&(*to)[len_to], buffer, len_what);
+
+	(*to)[len_to + len_what] = 0x00;
+
+	free(buffer);
+}
+
+void format_help(const char *short_str, const char *long_str, const char *descr)
+{
+	int par_width = SWITCHES_COLUMN_WIDTH, max_wrap_width = par_width / 2, cur_par_width = 0;
+	int descr_width = max_x - (par_width + 1);
+	char *line = NULL, *p = (char *)descr;
+	char first = 1;
+
+	if (long_str && short_str)
+		str_add(&line, "%-4s / %s", short_str, long_str);
+	else if (long_str)
+		str_add(&line, "%s", long_str);
+	else if (short_str)
+		str_add(&line, "%s", short_str);
+	else
+		line = strdup("");
+
+	cur_par_width = fprintf(stderr, "%-*s ", par_width, line);
+
+	free(line);
+
+	if (par_width + 1 >= max_x || cur_par_width >= max_x) {
+		fprintf(stderr, "%s\n", descr);
+		return;
+	}
+
+	for(;strlen(p);) {
+		char *n =  NULL, *kn = NULL, *copy = NULL;
+		int len_after_ww = 0, len_before_ww = 0;
+		int str_len = 0, cur_descr_width = first ? max_x - cur_par_width : descr_width;
+
+		while(*p == ' ')
+			p++;
+
+		str_len = strlen(p);
+		if (!str_len)
+			break;
+
+		len_before_ww = std::min(str_len, cur_descr_width);
+
+		n = &p[len_before_ww];
+		kn = n;
+
+		if (str_len > cur_descr_width) { 
+			int n_len = 0;
+
+			while (*n != ' ' && n_len < max_wrap_width) {
+				n--;
+				n_len++;
+			}
+
+			if (n_len >= max_wrap_width)
+				n = kn;
+		}
+
+		len_after_ww = (int)(n - p);
+		if (len_after_ww <= 0)
+			break;
+
+		copy = (char *)malloc(len_after_ww + 1);
+		memcpy(copy, p, len_after_ww);
+		copy[len_after_ww] = 0x00;
+
+		if (first)
+			first = 0;
+		else
+			fprintf(stderr, "%*s ", par_width, "");
+
+		fprintf(stderr, "%s\n", copy);
+
+		free(copy);
+
+		p = n;
+	}
+}
+
+void json_double(const char *name, const double v, const bool next)
+{
+	printf("\"%s\" : %f", name, v);
+
+	if (next)
+		printf(",\n");
+	else
+		printf("\n");
+}
+
+void json_uint32_t(const char *name, const uint32_t v, const bool next)
+{
+	printf("\"%s\" : %u", name, v);
+
+	if (next)
+		printf(",\n");
+	else
+		printf("\n");
+}
+
+void json_uint64_t(const char *name, const uint64_t v, const bool next)
+{
+	printf("\"%s\" : %llu", name, (unsigned long long)v);
+
+	if (next)
+		printf(",\n");
+	else
+		printf("\n");
+}
+
+void json_bool(const char *name, const bool v, const bool next)
+{
+	printf("\"%s\" : %s", name, v ? "true" : "false");
+
+	if (next)
+		printf(",\n");
+	else
+		printf("\n");
+}
+
+void json_string(const char *name, const std::string & v, const bool next)
+{
+	printf("\"%s\" : \"%s\"", name, v.c_str());
+
+	if (next)
+		printf(",\n");
+	else
+		printf("\n");
+}
+
+void dump_state(const std::string & name, const std::string & descr, const std::vector<uint8_t> & state, const bool json)
+{
+	if (json) {
+		printf("{\n");
+		json_string("name", name, true);
+		json_string("descr", descr, true);
+
+		json_double("battery-voltage", get_battery_voltage(state), true);
+		json_double("charging-current", get_charging_current(state), true);
+		json_double("HV-output-current", get_hv_output_current(state), true);
+		json_double("HV-output-voltage", get_hv_output_voltage(state), true);
+		json_double("USB-output-current", get_usb_output_current(state), true);
+		json_uint32_t("battery-uptime", get_battery_uptime(state), true);
+
+		std::vector<uint8_t> c = get_i2c_BQ24295(state);
+		for(unsigned i=0; i<unsigned(c.size()); i++) {
+			char *buffer = NULL;
+			asprintf(&buffer, "bq24295-reg-%u", i);
+
+			json_uint32_t(buffer, c.at(i), true);
+
+			free(buffer);
+		}
+
+		json_bool("battery-overvoltage", get_battery_overvoltage(state), true);
+		json_bool("auto-send-statemachine", get_auto_send_statemachine(state), true);
+		json_bool("virtual-serial-port-connected", get_virtual_serial_port_connected(state), true);
+		json_bool("charging-port-pluggend-in", get_charging_port_plugged_in(state), true);
+		json_bool("warnings-enabled", get_warnings_enabled(state), true);
+		json_bool("charger-fault", get_charger_fault(state), true);
+		json_bool("battery-too-cold", get_battery_too_cold(state), true);
+		json_bool("battery-too-hot", get_battery_too_hot(state), true);
+		json_bool("hv-output", get_hv_output_on(state), true);
+		json_bool("usb-output", get_usb_output_on(state), true);
+
+		const link_stats_t & ls = parser.get_stats();
+		json_uint64_t("link-frames-ok", ls.frames_ok, true);
+		json_uint64_t("link-frames-rejected", ls.frames_rejected, true);
+		json_uint64_t("link-bytes-discarded", ls.bytes_discarded, true);
+		json_uint64_t("link-resyncs", ls.resyncs, true);
+		json_uint64_t("link-relearned", ls.soft_rejects, false);
+		printf("}\n");
+	}
+	else {
+		printf(_("name:\t%s\n"), name.c_str());
+		printf(_("descr:\t%s\n"), descr.c_str());
+
+		printf(_("temperature:\t%f degreese celsius\n"), get_temp(state));
+		printf(_("battery voltage:\t%f V\n"), get_battery_voltage(state));
+		printf(_("charging current:\t%f A\n"), get_charging_current(state));
+		printf(_("HV output current:\t%f A\n"), get_hv_output_current(state));
+		printf(_("HV output voltage:\t%f V\n"), get_hv_output_voltage(state));
+		printf(_("USB output current:\t%f A\n"), get_usb_output_current(state));
+		printf(_("Battery uptime:\t%u seconds\n"), get_battery_uptime(state));
+
+		printf(_("BQ24295 registers:\t"));
+		std::vector<uint8_t> c = get_i2c_BQ24295(state);
+		for(size_t i=0; i<c.size(); i++) {
+			if (i)
+				printf(" ");
+
+			printf("%02x", c.at(i));
+		}
+		printf("\n");
+
+		if (get_battery_overvoltage(state))
+			printf(_("Battery overvoltage!!\n"));
+		if (get_auto_send_statemachine(state))
+			printf(_("Statemachine is in auto send mode\n"));
+		if (get_virtual_serial_port_connected(state))
+			printf(_("Virtual serial port connected\n"));
+		if (get_charging_port_plugged_in(state))
+			printf(_("Charging port plugged in\n"));
+		if (get_warnings_enabled(state))
+			printf(_("Warnings enabled\n"));
+		if (get_charger_fault(state))
+			printf(_("Charger fault\n"));
+		if (get_battery_too_cold(state))
+			printf(_("Battery too cold!\n"));
+		if (get_battery_too_hot(state))
+			printf(_("Battery too hot!!!\n"));
+		if (get_hv_output_on(state))
+			printf(_("HV output on\n"));
+		if (get_usb_output_on(state))
+			printf(_("USB output on\n"));
+
+		print_link_stats(stdout);
+	}
+}
+
+void putChar(char *line, int x, const char *c, const bool red)
+{
+	if (x < 0)
+		x = 0;
+
+	if (x >= max_x)
+		x = max_x -1;
+
+	memcpy(&line[x], c, strlen(c));
+
+	if (ansi_terminal()) {
+		fprintf(stderr, "\x1b[%dG", x + 1);
+
+		if (red)
+			fprintf(stderr, "\x1b[31m");
+		else
+			fprintf(stderr, "\x1b[32m");
+
+		fprintf(stderr, "%s", c);
+	}
+}
+
+void graph_scale(char *line, const double scale_voltage, const double scale_current)
+{
+	memset(line, ' ', max_x);
+	line[max_x - 1] = 0x00;
+
+	putChar(line, int(scale_current * 1.0), "C1", true);
+	putChar(line, int(scale_current * 2.0), "C2", true);
+
+	putChar(line, int(scale_voltage * 3.0), "V3", false);
+	putChar(line, int(scale_voltage * 5.0), "V5", false);
+	putChar(line, int(scale_voltage * 10.0), "V10", false);
+	putChar(line, int(scale_voltage * 15.0), "V15", false);
+	putChar(line, int(scale_voltage * 20.0), "V20", false);
+
+	if (!ansi_terminal())
+		printf("%s\n", line);
+}
+
+void graph_line(char *line, const std::vector<uint8_t> & state, const double scale_voltage, const double scale_current)
+{
+	double battery_voltage = get_battery_voltage(state);
+	double charging_current = get_charging_current(state);
+	double hv_output_current = get_hv_output_current(state);
+	double hv_output_voltage = get_hv_output_voltage(state);
+	double usb_output_current = get_usb_output_current(state);
+
+	memset(line, ' ', max_x);
+	line[max_x - 1] = 0x00;
+
+	int x;
+
+	x = battery_voltage * scale_voltage;
+	putChar(line, x, "|", false);
+
+	x = charging_current * scale_current;
+	putChar(line, x, "*", true);
+
+	x = hv_output_current * scale_current;
+	putChar(line, x, "+", true);
+
+	x = hv_output_voltage * scale_voltage;
+	putChar(line, x, "-", false);
+
+	x = usb_output_current * scale_current;
+	putChar(line, x, "#", true);
+
+	if (ansi_terminal())
+		fprintf(stderr, "\x1b[m\n");
+	else
+		printf("%s\n", line);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// terminal size, see determine_terminal_size()
+extern int max_x, max_y;
+
+bool ansi_terminal(void);
+void set_bold(bool on);
+void set_underline(bool on);
+void reset_term();
+void determine_terminal_size(void);
+
+void help_header(const char *str);
+void format_help(const char *short_str, const char *long_str, const char *descr);
+
+void json_double(const char *name, const double v, const bool next);
+void json_uint32_t(const char *name, const uint32_t v, const bool next);
+void json_uint64_t(const char *name, const uint64_t v, const bool next);
+void json_bool(const char *name, const bool v, const bool next);
+void json_string(const char *name, const std::string & v, const bool next);
+
+// -m dump output for a state frame, as text or JSON
+void dump_state(const std::string & name, const std::string & descr, const std::vector<uint8_t> & state, const bool json);
+
+// line must have room for max_x characters
+void putChar(char *line, int x, const char *c, const bool red);
+void graph_scale(char *line, const double scale_voltage, const double scale_current);
+void graph_line(char *line, const std::vector<uint8_t> & state, const double scale_voltage, const double scale_current);
@@ -0,0 +1,36 @@
+#include <functional>
+#include <signal.h>
+#include <stdint.h>
+#include <thread>
+#include <time.h>
+
+#include "utils.h"
+
+uint64_t get_us(const clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+
+	return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sleep_us(const uint64_t us)
+{
+	struct timespec ts = { time_t(us / 1000000), long(us % 1000000) * 1000 };
+
+	nanosleep(&ts, NULL);
+}
+
+std::thread *start_thread(std::function<void()> f)
+{
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	std::thread *th = new std::thread(f);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return th;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <functional>
+#include <stdint.h>
+#include <thread>
+#include <time.h>
+
+uint64_t get_us(const clockid_t clk);
+void sleep_us(const uint64_t us);
+
+// with all signals blocked: those are for the main thread
+std::thread *start_thread(std::function<void()> f);